@@ -14,6 +14,7 @@
 static const char *usage_args[] = {
         "[--extended]",
         "[--vm]",
+        "[--swap=<pages>]",
         "<bootblock>",  "<kernel>",
         "[process...]",
 };
@@ -22,6 +23,9 @@ static const char *usage_args[] = {
 #define OS_SIZE_LOC  2
 #define BOOT_MEM_LOC 0x7c00
 
+/* swap area reserved at the end of a --vm image, in pages (2 MB) */
+#define SWAP_DEFAULT_PAGES 512
+
 #define UNUSED(var) ((void) var)
 
 /* to align down to a page boundary, just mask off the last 12 bits */
@@ -32,28 +36,35 @@ static struct {
     const char *progname;
     bool        vm;
     bool        extended;
+    size_t      swap_pages;
     const char *bootblock;
     const char *kernel;
     size_t       process_count;
     const char **processes;
 } options;
 
-/* process directory entry */
+/* process directory entry, must match syslib/common.h */
 struct directory_t {
     int location;
     int size;
+    int mem_size;
 };
 
+/* must match PROCESS_DIR_SWAP_SLOT in syslib/common.h */
+#define SWAP_DIR_SLOT (SECTOR_SIZE / sizeof(struct directory_t) - 1)
+
 /* Image state */
 static struct image_t {
     FILE *img; /* the file pointer to the image file */
     FILE *fp;  /* the file pointer to the input file */
 
     size_t nbytes; /* bytes written so far */
+    size_t mem_end; /* image offset where the last segment's memory ends */
     int offset; /* offset of virtual address from physical address */
+    bool demand_zero; /* leave trailing bss out, the kernel zero-fills it */
 
     size_t pd_loc; /* the location for next process directory entry */
-    size_t pd_lim; /* the upper limit for process directory, one sector */
+    size_t pd_lim; /* the upper limit for process entries in the directory */
     struct directory_t dir;
 } image;
 
@@ -74,6 +85,7 @@ static void write_os_size(struct image_t *im);
 
 static void reserve_process_dir(struct image_t *im);
 static void add_process_to_dir(struct image_t *im);
+static void reserve_swap_area(struct image_t *im);
 
 static void process_start(struct image_t *im, int vaddr);
 static void process_end(struct image_t *im);
@@ -84,6 +96,7 @@ int main(int argc, const char **argv)
     options.progname = argv[0];
     options.vm       = 0;
     options.extended = 0;
+    options.swap_pages = SWAP_DEFAULT_PAGES;
 
     int i = 1;
 
@@ -96,6 +109,13 @@ int main(int argc, const char **argv)
         } else if (strcmp(argv[i], "--vm") == 0) {
             options.vm = true;
 
+        } else if (strncmp(argv[i], "--swap=", 7) == 0) {
+            char *end;
+            options.swap_pages = strtoul(argv[i] + 7, &end, 0);
+            if (*end != '\0') {
+                usage_error("invalid swap size '%s'\n", argv[i] + 7);
+            }
+
         } else {
             usage_error("unknown option '%s'\n", argv[i]);
         }
@@ -133,6 +153,9 @@ static void create_image()
         reserve_process_dir(&image);
     }
 
+    /* processes are paged, their bss needs no room in the image */
+    image.demand_zero = options.vm;
+
     for (size_t i = 0; i < options.process_count; i++) {
         add_file(&image, options.processes[i]);
         if (options.vm) {
@@ -142,6 +165,8 @@ static void create_image()
 
     if (!options.vm) {
         write_os_size(&image);
+    } else {
+        reserve_swap_area(&image);
     }
 
     assert((image.nbytes % SECTOR_SIZE) == 0);
@@ -218,6 +243,7 @@ static void process_start(struct image_t *im, int vaddr)
      */
     assert((im->nbytes % SECTOR_SIZE) == 0);
     im->dir.location = im->nbytes / SECTOR_SIZE;
+    im->mem_end      = im->nbytes;
 
     if (im->nbytes == 0) {
         /* this is the first image, it's got to be the boot block */
@@ -238,6 +264,14 @@ static void process_start(struct image_t *im, int vaddr)
 
 static void process_end(struct image_t *im)
 {
+    /* write out the zeros of the last bss, unless it is left to the kernel */
+    if (!im->demand_zero) {
+        while (im->nbytes < im->mem_end) {
+            fputc(0, im->img);
+            im->nbytes++;
+        }
+    }
+
     /* write padding after the process */
     if (im->nbytes % SECTOR_SIZE != 0) {
         while (im->nbytes % SECTOR_SIZE != 0) {
@@ -248,10 +282,13 @@ static void process_end(struct image_t *im)
     }
     /* the size, in sector, of the current process image */
     im->dir.size = im->nbytes / SECTOR_SIZE - im->dir.location;
+    /* and in memory, including bss that is not in the image */
+    im->dir.mem_size = (im->mem_end + SECTOR_SIZE - 1) / SECTOR_SIZE - im->dir.location;
+    if (im->dir.mem_size < im->dir.size) im->dir.mem_size = im->dir.size;
 
     verbose_printf(
-            "\tProcess starts at sector %d, and spans for %d sectors\n",
-            im->dir.location, im->dir.size
+            "\tProcess starts at sector %d, and spans for %d sectors (%d in memory)\n",
+            im->dir.location, im->dir.size, im->dir.mem_size
     );
 }
 
@@ -273,7 +310,10 @@ static void write_segment(struct image_t *im, Elf32_Ehdr ehdr, Elf32_Phdr phdr)
               phyaddr, im->nbytes);
     }
 
-    /* write padding before the segment */
+    /*
+     * write padding before the segment, this also fills in the bss of
+     * the segment before
+     */
     if (im->nbytes < phyaddr) {
         while (im->nbytes < phyaddr) {
             fputc(0, im->img);
@@ -283,19 +323,20 @@ static void write_segment(struct image_t *im, Elf32_Ehdr ehdr, Elf32_Phdr phdr)
     }
 
     /* write the segment itself */
-    verbose_printf("\t\twriting 0x%04x bytes\n", phdr.p_memsz);
+    verbose_printf("\t\twriting 0x%04x bytes (0x%04x in memory)\n", phdr.p_filesz, phdr.p_memsz);
 
     fseek(im->fp, phdr.p_offset, SEEK_SET);
     while (phdr.p_filesz-- > 0) {
         fputc(fgetc(im->fp), im->img);
         im->nbytes++;
-        phdr.p_memsz--;
-    }
-    while (phdr.p_memsz-- > 0) {
-        fputc(0, im->img);
-        im->nbytes++;
     }
 
+    /*
+     * The zero-filled rest of the segment is only written if another
+     * segment or process_end() needs it to be
+     */
+    if (phyaddr + phdr.p_memsz > im->mem_end) im->mem_end = phyaddr + phdr.p_memsz;
+
     /*
      * Note: Modified by Han Chen
      * padding here is removed to process_end, this will allow
@@ -335,7 +376,8 @@ static void reserve_process_dir(struct image_t *im)
     assert(options.vm);
 
     im->pd_loc = im->nbytes;
-    im->pd_lim = im->nbytes + SECTOR_SIZE;
+    /* the last entry is reserved for the swap area */
+    im->pd_lim = im->nbytes + SWAP_DIR_SLOT * sizeof(struct directory_t);
 
     verbose_printf(
             "reserving space for process directory: %#lx to %#lx\n",
@@ -359,8 +401,8 @@ static void add_process_to_dir(struct image_t *im)
 
     verbose_printf(
             "\tadding process to directory: "
-            "slot %#06lx, img offset %#06x, size %#06x \n",
-            im->pd_loc, im->dir.location, im->dir.size
+            "slot %#06lx, img offset %#06x, size %#06x, mem size %#06x \n",
+            im->pd_loc, im->dir.location, im->dir.size, im->dir.mem_size
     );
 
     fseek(im->img, im->pd_loc, SEEK_SET);
@@ -371,6 +413,38 @@ static void add_process_to_dir(struct image_t *im)
     fseek(im->img, 0, SEEK_END);
 }
 
+/*
+ * Append a zeroed swap area to the image and record it in the last entry of
+ * the process directory. The kernel writes dirty pages there instead of back
+ * into the process images.
+ */
+static void reserve_swap_area(struct image_t *im)
+{
+    static const char zero[SECTOR_SIZE];
+    struct directory_t swap;
+
+    assert(options.vm);
+    assert((im->nbytes % SECTOR_SIZE) == 0);
+
+    swap.location = options.swap_pages ? im->nbytes / SECTOR_SIZE : 0;
+    swap.size     = options.swap_pages * (PAGE_SIZE / SECTOR_SIZE);
+    swap.mem_size = swap.size;
+
+    verbose_printf(
+            "reserving swap area: img offset %#06x, size %#06x sectors\n",
+            swap.location, swap.size
+    );
+
+    for (int i = 0; i < swap.size; i++) {
+        fwrite(zero, SECTOR_SIZE, 1, im->img);
+        im->nbytes += SECTOR_SIZE;
+    }
+
+    fseek(im->img, im->pd_lim, SEEK_SET);
+    fwrite(&swap, sizeof(struct directory_t), 1, im->img);
+    fseek(im->img, 0, SEEK_END);
+}
+
 ATTR_UNUSED
 ATTR_PRINTFLIKE(1, 2) static void verbose_printf(const char *fmt, ...)
 {
@@ -20,6 +20,7 @@
 #include "hardware/intctl_8259.h"
 #include "cpu.h"
 #include "scheduler.h"
+#include "syscall.h"
 
 /*
  * Define an assembly constant
@@ -80,4 +81,6 @@ void foo()
     ASM_OFFSET(PCB_DS, struct pcb, ds);
     ASM_OFFSET(PCB_CS, struct pcb, cs);
 
+    ASM_CONST(SYSCALL_FRAME_SIZE);
+
 }
@@ -46,11 +46,108 @@
 #define PROCESSES_SHARE_KERNEL_PAGE_TABLE 1
 #define PIN_SHELL 0
 
+// Identity map the memory above the first 4MB with 4MB pages, and make the
+// identity map global so that it stays in the TLB across page directory
+// switches. Ignored if the CPU has no PSE and PGE.
+#define KERNEL_LARGE_PAGES 1
+
+// FIFO and RANDOM evict hot pages (shell code, mailbox buffers) as readily
+// as cold ones. CLOCK is an enhanced second-chance policy that looks at the
+// accessed/dirty bits of every mapping of a frame and prefers clean frames
+// that have not been referenced since the clock hand last passed them.
+// WSCLOCK evicts pages that have not been used in the last WSCLOCK_TAU
+// millisecs of their owner's CPU time, and has the reclaim thread write
+// up to WSCLOCK_WRITEBACK_PAGES such pages to swap ahead of eviction if
+// they are dirty.
 enum {
     EVICTION_STRATEGY_FIFO = 1,
     EVICTION_STRATEGY_RANDOM = 2,
+    EVICTION_STRATEGY_CLOCK = 3,
+    EVICTION_STRATEGY_WSCLOCK = 4,
 };
-#define EVICTION_STRATEGY EVICTION_STRATEGY_FIFO
+#define EVICTION_STRATEGY EVICTION_STRATEGY_CLOCK
+#define WSCLOCK_TAU             50 // millisecs of virtual time
+#define WSCLOCK_WRITEBACK_PAGES 8
+
+// Page trace: with PGTRACE set, page faults and evictions are recorded in
+// a ring of PGTRACE_RING_RECORDS records and written to COM2, for replay
+// by the pagesim tool on the host.
+#define PGTRACE              0
+#define PGTRACE_RING_RECORDS 1024
+
+// Fault-around: a fault on a page of the process image also reads the
+// following pages of the image in the same SCSI transfer. The window
+// doubles for processes that fault sequentially, and halves when a page
+// read this way is evicted without having been touched.
+// Every 64 byte USB packet needs a transfer descriptor from the 64 KB
+// USB heap, so the window can't be very large.
+// The transfer goes into one buffer, so the pages read ahead need frames
+// physically following the faulting page's frame. The window is cut to the
+// longest run of free frames there is, and once the free lists are
+// fragmented, or only eviction or the standby list can supply a frame, a
+// fault reads just its own page.
+#define FAULT_AROUND_MAX_PAGES     4
+#define FAULT_AROUND_INITIAL_PAGES 2
+
+// A kernel thread zeroes free frames ahead of time, so a page that must
+// start out zero can be handed out on a fault without clearing it first.
+// It keeps up to ZERO_POOL_PAGES frames zeroed and sleeps while the pool
+// is full or there is nothing to zero.
+#define ZERO_POOL_PAGES   32
+#define ZERO_THREAD_SLEEP 50 // millisecs
+
+// Background reclaim: a kernel thread evicts pages in batches of up to
+// RECLAIM_BATCH_PAGES when fewer than RECLAIM_LOW_PAGES frames are free,
+// until RECLAIM_HIGH_PAGES are. Small memories get lower watermarks (an
+// eighth and a quarter of the frames). Faults only evict themselves if
+// the thread falls behind.
+#define RECLAIM_LOW_PAGES    32
+#define RECLAIM_HIGH_PAGES   64
+#define RECLAIM_BATCH_PAGES  8
+#define RECLAIM_THREAD_SLEEP 10 // millisecs
+
+// Image pages are shared between processes started from the same image
+// through a page cache, hashed on disk sector into PAGE_CACHE_BUCKETS
+// chains. Writing to a shared page gives the writer a copy of its own.
+#define PAGE_CACHE_BUCKETS 256
+
+// User stacks are zero-filled on demand below PROCESS_STACK_VADDR and may
+// grow to USER_STACK_MAX_PAGES. A process touching the page below that is
+// killed.
+#define USER_STACK_MAX_PAGES 16
+
+// Pages evicted by the reclaim thread keep their frames on a standby list,
+// hashed on pid and address into STANDBY_BUCKETS chains, until the frames
+// are needed. A fault on such a page maps its frame back without any I/O.
+#define STANDBY_BUCKETS 64
+
+// Resident set quotas: a process with RSS_QUOTA pages mapped replaces its
+// own pages when it faults instead of taking frames from others (with the
+// CLOCK and WSCLOCK strategies). Quotas start at RSS_QUOTA_INITIAL pages.
+// Every PFF_INTERVAL millisecs a process with more than PFF_HIGH_FAULTS
+// faults in the interval gets PFF_STEP_PAGES more, up to RSS_QUOTA_MAX or
+// half the frames, and one with fewer than PFF_LOW_FAULTS gets
+// PFF_STEP_PAGES less, down to RSS_QUOTA_MIN, and is trimmed to fit.
+#define RSS_QUOTA_INITIAL 64
+#define RSS_QUOTA_MIN     16
+#define RSS_QUOTA_MAX     1024
+#define PFF_INTERVAL      200 // millisecs
+#define PFF_HIGH_FAULTS   16
+#define PFF_LOW_FAULTS    2
+#define PFF_STEP_PAGES    8
+
+// Dirty pages are compressed into a pool of ZSWAP_POOL_PAGES frames when
+// evicted, each taking whole chunks of ZSWAP_CHUNK_SIZE bytes in one frame,
+// and faulted back in from there. Pages that don't compress to
+// ZSWAP_MAX_SIZE bytes are written to swap right away, and when the pool is
+// full the oldest pages in it are. It holds at most ZSWAP_MAX_ENTRIES
+// pages. Statistics are logged every ZSWAP_STATS_INTERVAL evictions.
+// Setting ZSWAP_POOL_PAGES to 0 turns it off.
+#define ZSWAP_POOL_PAGES     32
+#define ZSWAP_CHUNK_SIZE     128
+#define ZSWAP_MAX_SIZE       2048
+#define ZSWAP_MAX_ENTRIES    256
+#define ZSWAP_STATS_INTERVAL 64
 ////////////////////////////////////////////////////////////////////////////////////////
 
 
@@ -58,18 +155,14 @@ enum {
 ///////////////////////////////////////////////////////////////////////////////////////
 // Shell behaviour
 ///////////////////////////////////////////////////////////////////////////////////////
-// There are three or four pinned pages per process depending on sharing strategy.
-// Pinned for stack, page directory and user space page table.
-// kernel page table is either shared among processes or pinned, depending on strategy.
-// On average about three to four pages per process are required to avoid thrashing,
-// totaling about 7 pages per process.
-// This last number could be modeled better with. eg
-// a percentage of the size of the images loaded to memory. The idea is to
-// keep competition for page frames at tolerable level to avoid thrashing.
-
-// limits the number of running processes if set to 1
-#define SCHEDULE_PROCESS_LAUNCHING 1
-
-#define AVERAGE_PAGES_PER_PROCESS 7
-#define NEW_PROCESS_WAIT_TIME_FOR_PAGES 1000 // millisecs
+// Load control: a new process starts when its image (up to RSS_QUOTA_INITIAL
+// pages) fits in memory next to the estimated demand of the running ones,
+// their resident sets and more while they fault often, or when nothing else
+// is runnable. When the processes fault more than LOADCTL_THRASH_FAULTS times
+// per PFF_INTERVAL together, the runnable one that has waited longest to run
+// is suspended and swapped out. Suspended processes are resumed when the
+// faults drop below LOADCTL_RESUME_FAULTS. Setting LOADCTL to 0 turns it off.
+#define LOADCTL               1
+#define LOADCTL_THRASH_FAULTS 64
+#define LOADCTL_RESUME_FAULTS 16
 ///////////////////////////////////////////////////////////////////////////////////////
\ No newline at end of file
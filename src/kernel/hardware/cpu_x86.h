@@ -355,13 +355,46 @@ static inline void set_page_directory(ureg_t *pagedir)
     asm volatile("movl %0, %%cr3 " ::"r"(pagedir));
 }
 
-/* This function enables paging by setting CR0[31] to 1. */
+enum {
+    CR4_PSE = 1 << 4, /* 4MB pages */
+    CR4_PGE = 1 << 7, /* global pages */
+
+    CPUID_EDX_PSE = 1 << 3,
+    CPUID_EDX_PGE = 1 << 13,
+};
+
+/* Feature flags in EDX of CPUID leaf 1 */
+static inline uint32_t cpuid_features_edx(void)
+{
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return edx;
+}
+
+/* Set 'bits' in CR4 */
+static inline void cr4_set(ureg_t bits)
+{
+    ureg_t tmp;
+    asm inline volatile(
+            "movl	%%cr4,	%0\n"
+            "orl	%1,	%0\n"
+            "movl	%0,	%%cr4\n"
+            : "=&r"(tmp)
+            : "r"(bits)
+    );
+}
+
+/*
+ * This function enables paging by setting CR0[31] to 1. CR0[16] (WP) is set
+ * as well, so that the kernel also faults when writing to a read-only user
+ * page, which copy on write depends on.
+ */
 static inline void enable_paging()
 {
     ureg_t tmp;
     asm inline volatile(
             "movl	%%cr0,	%0\n"
-            "orl	$0x80000000,	%0\n"
+            "orl	$0x80010000,	%0\n"
             "movl	%0,	%%cr0\n"
             : "=r"(tmp)
     );
@@ -386,7 +419,13 @@ static inline uintptr_t load_page_fault_addr()
 /* Invalidate page that contains the given virtual address */
 static inline void invalidate_page(uintptr_t *vaddr)
 {
-    asm volatile("invlpg %0" : : "m"(vaddr));
+    asm volatile("invlpg %0" : : "m"(*(char *) vaddr) : "memory");
+}
+
+/* Flush all (non-global) TLB entries by reloading CR3 */
+static inline void flush_tlb(void)
+{
+    set_page_directory((ureg_t *) load_current_page_directory());
 }
 
 /* === I/O === */
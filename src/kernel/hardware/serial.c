@@ -65,3 +65,13 @@ void serial_puts(ioport_t port, const char *str)
     }
 }
 
+void serial_write(ioport_t port, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    serial_set_data_bits(port, DBITS_8); // Set for 8-bit character output
+
+    for (size_t i = 0; i < len; i++) {
+        serial_putc(port, p[i]);
+    }
+}
@@ -7,6 +7,8 @@
 #ifndef SERIAL_H
 #define SERIAL_H
 
+#include <stddef.h>
+
 #include "cpu_x86.h"
 
 #define PORT_COM1 0x3f8
@@ -14,5 +16,6 @@
 
 int  serial_putc(ioport_t port, char ch);
 void serial_puts(ioport_t port, const char *str);
+void serial_write(ioport_t port, const void *buf, size_t len);
 
 #endif /* SERIAL_H */
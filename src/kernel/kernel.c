@@ -38,6 +38,9 @@ static uintptr_t start_thrds[] = {
         (uintptr_t) loader_thread, /* Loads shell */
         (uintptr_t) clock_thread,  /* Running indefinitely */
         (uintptr_t) usb_thread,    /* Scans USB hub port */
+        (uintptr_t) page_zero_thread, /* Zeroes free page frames */
+        (uintptr_t) page_reclaim_thread, /* Keeps page frames free */
+        (uintptr_t) reaper_thread, /* Frees what exited tasks leave */
         (uintptr_t) lock_thread0,  /* Test thread */
         (uintptr_t) lock_thread1,  /* Test thread */
 
@@ -73,7 +76,7 @@ void kernel_main(void)
 
     /* Initialize various "subsystems" */
     time_init();
-    init_memory();
+    init_memory((const struct memory_map *) MEMORY_MAP_PADDR);
     mbox_init();
     keyboard_init();
     scsi_static_init();
@@ -0,0 +1,195 @@
+/*
+ * Load control: keeping the number of processes competing for memory down
+ * to what fits, so that they don't thrash.
+ *
+ * The memory demand of a process is estimated from its resident set, plus
+ * some while it is faulting often, and from the size of its image until
+ * its resident set has grown to that (or its quota, for a process that
+ * hardly faults). A new process, of which only the image is known, starts
+ * once its estimate fits next to the demand of the others, or when no
+ * other process is runnable and so can't compete with it. Until then it
+ * waits in loadctl_admit(), woken when frames are freed.
+ *
+ * If the processes fault more than LOADCTL_THRASH_FAULTS times per
+ * PFF_INTERVAL together anyway, the runnable process that has waited the
+ * longest to run is suspended, and the reclaim thread evicts its pages and
+ * then the page tables that mapped them, see ptable_trim(). It is only
+ * suspended at its next preemption from user mode, where it holds no locks
+ * the reclaim thread could need. Suspended processes are resumed, oldest
+ * first, when the faults drop below LOADCTL_RESUME_FAULTS and their demand
+ * fits.
+ */
+
+#define pr_fmt(fmt) "loadctl: " fmt
+
+#include "loadctl.h"
+
+#include <stdbool.h>
+
+#include <syslib/common.h>
+
+#include "lib/printk.h"
+#include "memory.h"
+#include "pcb.h"
+#include "scheduler.h"
+#include "sync.h"
+
+#include "config.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/* Launches waiting for memory */
+static pcb_t *loadctl_waiting;
+
+/* Pages a process with an image of 'mem_size' sectors may grow to */
+static uint32_t image_pages(uint32_t mem_size)
+{
+    // and a page of stack
+    return (mem_size * SECTOR_SIZE + PAGE_SIZE - 1) / PAGE_SIZE + 1;
+}
+
+/* Whether 'p' is a user process that is alive and not suspended */
+static bool process_active(pcb_t *p)
+{
+    return p->pid != 0 && !p->is_thread && p->status != STATUS_EXITED && !p->suspended;
+}
+
+/* Pages 'p' is estimated to need to run without thrashing */
+static uint32_t process_demand(pcb_t *p)
+{
+    // a process still faulting its pages in will need more than it has
+    uint32_t observed = p->rss + (p->fault_rate > PFF_HIGH_FAULTS ? PFF_STEP_PAGES : 0);
+
+    return MAX(observed, MIN(image_pages(p->mem_size), p->rss_quota));
+}
+
+/*
+ * Frames that processes can have, leaving an eighth of memory for the
+ * kernel, the page cache and the reclaim thread's free frames.
+ */
+static uint32_t frame_budget(void)
+{
+    return pageable_page_count() - pageable_page_count() / 8;
+}
+
+/*
+ * Total demand of the active processes, and how many of them other than
+ * the one running are runnable. Interrupts must be disabled.
+ */
+static uint32_t total_demand(uint32_t *runnable)
+{
+    uint32_t demand = 0;
+
+    *runnable = 0;
+    for (pcb_t *p = pcb; p < pcb + PCB_TABLE_SIZE; p++) {
+        if (!process_active(p)) continue;
+        demand += process_demand(p);
+        if (p != current_running
+            && (p->status == STATUS_READY || p->status == STATUS_FIRST_TIME)) {
+            (*runnable)++;
+        }
+    }
+    return demand;
+}
+
+void loadctl_admit(uint32_t mem_size)
+{
+    uint32_t need = MIN(image_pages(mem_size), RSS_QUOTA_INITIAL);
+    uint32_t runnable;
+    bool     waited = false;
+
+    if (!LOADCTL) return;
+
+    nointerrupt_enter();
+    while (total_demand(&runnable) + need > frame_budget() && runnable > 0) {
+        if (!waited) pr_debug("waiting for %u pages to start a process\n", need);
+        waited = true;
+        block(&loadctl_waiting);
+    }
+    nointerrupt_leave();
+}
+
+void loadctl_wakeup(void)
+{
+    nointerrupt_enter();
+    while (loadctl_waiting) unblock(&loadctl_waiting);
+    nointerrupt_leave();
+}
+
+void loadctl_preempt(void)
+{
+    // only when interrupted in user mode, not in a system call
+    if (current_running->suspend_requested && current_running->nested_count == 1) {
+        current_running->suspend_requested = false;
+        current_running->suspended         = true;
+    }
+}
+
+/* The runnable process that has waited longest to run, or NULL */
+static pcb_t *longest_idle(void)
+{
+    pcb_t *idle = NULL;
+
+    for (pcb_t *p = pcb; p < pcb + PCB_TABLE_SIZE; p++) {
+        if (!process_active(p) || p->suspend_requested || p->status != STATUS_READY) continue;
+        if (!idle || p->dispatch_time < idle->dispatch_time) idle = p;
+    }
+    return idle;
+}
+
+/* The process that has been suspended longest, or NULL */
+static pcb_t *longest_suspended(void)
+{
+    pcb_t *oldest = NULL;
+
+    for (pcb_t *p = pcb; p < pcb + PCB_TABLE_SIZE; p++) {
+        if (p->pid == 0 || p->status == STATUS_EXITED || !p->suspended) continue;
+        if (!oldest || p->dispatch_time < oldest->dispatch_time) oldest = p;
+    }
+    return oldest;
+}
+
+void loadctl_update(void)
+{
+    uint32_t faults = 0, runnable, demand;
+
+    if (!LOADCTL) return;
+
+    nointerrupt_enter();
+    for (pcb_t *p = pcb; p < pcb + PCB_TABLE_SIZE; p++) {
+        // a request not acted on yet is made again if still thrashing
+        p->suspend_requested = false;
+        if (process_active(p)) faults += p->fault_rate;
+    }
+    demand = total_demand(&runnable);
+
+    if (faults > LOADCTL_THRASH_FAULTS) {
+        // suspending the last runnable process would gain nothing
+        pcb_t *victim = runnable > 1 ? longest_idle() : NULL;
+        if (victim) {
+            victim->suspend_requested = true;
+            pr_log("%u faults in %u ms, suspending pid %u\n", faults, PFF_INTERVAL,
+                   victim->pid);
+        }
+    } else if (faults < LOADCTL_RESUME_FAULTS) {
+        pcb_t *p = longest_suspended();
+        // it had as much as its quota before it was swapped out
+        if (p && demand + MAX(p->rss_quota, p->rss) <= frame_budget()) {
+            p->suspended = false;
+            pr_log("resuming pid %u\n", p->pid);
+        }
+    }
+    nointerrupt_leave();
+
+    // swap out the suspended processes, they won't be needing their pages,
+    // nor the page tables mapping them
+    for (pcb_t *p = pcb; p < pcb + PCB_TABLE_SIZE; p++) {
+        while (p->pid != 0 && p->suspended && p->rss > 0 && rss_trim(p)) {
+        }
+        if (p->pid != 0 && p->suspended) ptable_trim(p);
+    }
+
+    // the demand has been estimated anew
+    loadctl_wakeup();
+}
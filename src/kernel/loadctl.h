@@ -0,0 +1,24 @@
+#ifndef LOADCTL_H
+#define LOADCTL_H
+
+#include <stdint.h>
+
+/*
+ * Wait until there is memory for a new process with an image of 'mem_size'
+ * sectors to start. Called by create_process().
+ */
+void loadctl_admit(uint32_t mem_size);
+
+/* Frames have been freed, let waiting launches check again */
+void loadctl_wakeup(void);
+
+/*
+ * Suspend or resume processes by the global fault rate. Called by the
+ * reclaim thread every PFF_INTERVAL, right after the quotas are adjusted.
+ */
+void loadctl_update(void);
+
+/* Called by preempt(), suspends the process if it has been asked to */
+void loadctl_preempt(void);
+
+#endif /* !LOADCTL_H */
@@ -1,10 +1,25 @@
 /*
  * Note:
- * There is no separate swap area. When a data page is swapped out,
- * it is stored in the location it was loaded from in the process'
- * image. This means it's impossible to start two processes from the
- * same image without screwing up the running. It also means the
- * disk image is read once. And that we cannot use the program disk.
+ * Process images on the USB stick are read-only. When a dirty page is
+ * evicted it is written to a slot in the swap area (see swap.c), and the
+ * non-present page table entry records the slot: PE_SWAPPED is set and the
+ * base address bits hold the slot number. A page that is clean when evicted
+ * is read back from wherever it came from, the image or its swap slot.
+ *
+ * Pages read from an image are kept in a page cache keyed by their disk
+ * sector, so processes started from the same image share them. They are
+ * mapped read-only with PE_COW set, and a write fault gives the writer a
+ * page of its own, see cow_page_fault().
+ *
+ * Locking:
+ * The frame table, the free list and the replacement state are only
+ * touched with interrupts disabled, and never across disk I/O. Each
+ * process has a vmem_lock serializing changes to its own page tables.
+ * A page table entry that is not present but has PE_BUSY set belongs to a
+ * page on its way to or from disk; faults on it wait on the owner's
+ * vmem_busy condition instead of starting a second read. Nothing that can
+ * evict, and so take another process' vmem_lock, is called with a
+ * vmem_lock held, except when setting up a process nobody else can see.
  */
 
 #include <kernel/hardware/cpu_x86.h>
@@ -25,9 +40,15 @@
 #include "lib/assertk.h"
 #include "lib/printk.h"
 #include "lib/todo.h"
+#include "loadctl.h"
 #include "memory.h"
+#include "pgtrace.h"
 #include "scheduler.h"
+#include "sleep.h"
+#include "swap.h"
 #include "sync.h"
+#include "time.h"
+#include "zswap.h"
 #include "usb/scsi.h"
 
 #include "config.h"
@@ -43,7 +64,6 @@
 #define MEMDEBUG           1
 #define DEBUG_PAGEFAULT    0
 #define MEM_DEBUG_LOADPROC 0
-#define USER_STACK_SIZE    0x1000
 
 #define MIN(x, y) (x < y ? x : y)
 
@@ -70,6 +90,12 @@ enum {
     PE_INFO_KERNEL_DUMMY = 1 << 1, /* kernel ''dummy'' */
     PE_INFO_PINNED       = 1 << 2, /* pinned */
     PE_INFO_STACK        = 1 << 3,
+    PE_INFO_PREFETCHED   = 1 << 4, /* read by fault-around, not yet used */
+    PE_INFO_IN_TRANSIT   = 1 << 5, /* being read from disk, not mapped yet */
+    PE_INFO_FREE         = 1 << 6, /* on the free list */
+    PE_INFO_ZEROED       = 1 << 7, /* free and known to be zero */
+    PE_INFO_CACHED       = 1 << 8, /* image page in the page cache */
+    PE_INFO_STANDBY      = 1 << 9, /* evicted, contents kept for a fault */
 };
 
 /* === Simple memory allocation === */
@@ -77,209 +103,734 @@ enum {
 static uintptr_t  next_free_mem;
 static spinlock_t next_free_mem_lock   = SPINLOCK_INIT;
 
-/* === Page allocation tracking === */
-static lock_t page_map_lock = LOCK_INIT;
-static spinlock_t page_frame_info_lock = SPINLOCK_INIT;
+/* Carve 'size' bytes off the start of the paging area, at boot only */
+static void *alloc_memory(uint32_t size)
+{
+    spinlock_acquire(&next_free_mem_lock);
+    void *ptr      = (void *) next_free_mem;
+    next_free_mem += (size + 3) & ~3;
+    spinlock_release(&next_free_mem_lock);
+    return ptr;
+}
 
 inline uint32_t get_table_index(uint32_t vaddr);
 uint32_t       *get_page_table(uint32_t vaddr, uint32_t *page_directory);
+uint32_t       *get_page_table_entry(uint32_t vaddr, uint32_t *page_directory);
 bool            is_page_dirty(uint32_t vaddr, uint32_t *page_directory);
 uint32_t       *try_evict_page();
-uint32_t        calculate_info_index(uintptr_t *paddr);
 inline uint32_t get_directory_index(uint32_t vaddr);
 void unmap_physical_page(uint32_t *process_directory, uint32_t vaddr);
+static void page_set_swapped(uint32_t *pdir, uint32_t vaddr, int slot);
+static uint32_t *ptable_fault_in(pcb_t *pcb, uint32_t vaddr);
+static uint32_t virtual_msecs(pcb_t *p);
 void print_page_table_info(void);
 void print_fifo_queue();
+void inc_pinned_pages(int increment);
+void add_page_frame_to_free_list_info(uintptr_t *paddr);
+
+/* === Frame table === */
+
+/*
+ * The frame table has one slot per pageable frame, kept as parallel arrays
+ * of small integers so that a sweep over it touches few cache lines. It is
+ * carved off the start of the paging area at boot and sized by the amount
+ * of memory found, see frame_table_init().
+ *
+ * Frames are named by their frame_t index. The mappings of a frame are
+ * kept in the rmap pool below, chained through rmap_t indices. The first
+ * mapping in the chain is the frame's main one.
+ */
+typedef uint16_t frame_t;
+typedef uint16_t rmap_t;
+
+#define FRAME_NONE ((frame_t) 0xffff)
+#define RMAP_NONE  ((rmap_t) 0)
+
+static uint32_t frame_count;     /* number of pageable frames */
+static uint32_t frame_base;      /* physical address of frame 0 */
+static uint32_t paging_area_end; /* physical address past the last frame */
+
+static uint16_t *frame_flags;     /* PE_INFO_* */
+static rmap_t   *frame_rmap;      /* first mapping, RMAP_NONE if unused */
+static int16_t  *frame_swap_slot; /* copy of the page in swap */
+static frame_t  *frame_next_free; /* the free list is doubly linked, so */
+static frame_t  *frame_prev_free; /* any given frame can be taken off it */
+static uint32_t *frame_cache_sector; /* disk sector of a cached image page, */
+                                     /* or vaddr of a standby page */
+static frame_t  *frame_cache_next;   /* page cache or standby hash chain */
+static uint32_t *frame_standby_pid;  /* process a standby page was evicted from */
+static uint32_t *frame_last_use;     /* owner's virtual time of the last use */
+
+static frame_t  frame_free_head = FRAME_NONE;
+static frame_t  frame_zero_head = FRAME_NONE;
+static uint32_t free_page_count; /* on either free list */
+static uint32_t zero_page_count;
+
+/* Mapped read-only wherever a process has bss it has not written to yet */
+static uint32_t *shared_zero_page;
+
+/* Frame indices in the order they were paged in, for FIFO replacement */
+static struct {
+    uint32_t next_in, next_out;
+    frame_t *queue; /* frame_count slots */
+    uint32_t items;
+} fifo_queue;
+
+/* Bytes of frame table per frame, including the FIFO queue slot */
+#define FRAME_TABLE_ENTRY_SIZE \
+    (sizeof(*frame_flags) + sizeof(*frame_rmap) + sizeof(*frame_swap_slot) \
+     + sizeof(*frame_next_free) + sizeof(*frame_prev_free) \
+     + sizeof(*frame_cache_sector) + sizeof(*frame_cache_next) \
+     + sizeof(*frame_standby_pid) + sizeof(*frame_last_use) \
+     + sizeof(*fifo_queue.queue))
+
+/* "Hashing" function carrying physical page addresses into the frame table */
+static inline frame_t frame_index(uintptr_t *paddr)
+{
+    return ((uint32_t) paddr - frame_base) / PAGE_SIZE;
+}
+
+static inline uintptr_t *frame_paddr(frame_t frame)
+{
+    return (uintptr_t *) (frame_base + frame * PAGE_SIZE);
+}
+
+/* Physical address of the frame 'n' frames after 'paddr' */
+static inline uintptr_t *page_frame_at(uintptr_t *paddr, uint32_t n)
+{
+    return (uintptr_t *) ((uint32_t) paddr + n * PAGE_SIZE);
+}
+
+/* === Page cache === */
+
+/*
+ * Frames holding image pages, hashed on the disk sector the page was read
+ * from. Sectors are unique across images, so the key needs no image id.
+ * Chains run through frame_cache_next. A frame leaves the cache when it is
+ * freed or a process writing to it takes it over. Only touched with
+ * interrupts disabled.
+ */
+static frame_t page_cache[PAGE_CACHE_BUCKETS];
+
+static inline frame_t *page_cache_bucket(uint32_t sector)
+{
+    return &page_cache[(sector / SECTORS_PER_PAGE) % PAGE_CACHE_BUCKETS];
+}
+
+/* Cached frame holding the image page at 'sector', FRAME_NONE if none */
+static frame_t page_cache_lookup(uint32_t sector)
+{
+    frame_t frame = *page_cache_bucket(sector);
+
+    while (frame != FRAME_NONE && frame_cache_sector[frame] != sector) {
+        frame = frame_cache_next[frame];
+    }
+    // a frame on its way out cannot take new mappings
+    if (frame != FRAME_NONE && (frame_flags[frame] & PE_INFO_IN_TRANSIT)) {
+        return FRAME_NONE;
+    }
+    return frame;
+}
+
+/*
+ * Caches 'frame' as the image page at 'sector'. Returns false if another
+ * frame already holds it, the caller then keeps 'frame' private.
+ */
+static bool page_cache_insert(frame_t frame, uint32_t sector)
+{
+    frame_t *head = page_cache_bucket(sector);
+
+    for (frame_t f = *head; f != FRAME_NONE; f = frame_cache_next[f]) {
+        if (frame_cache_sector[f] == sector) return false;
+    }
+    frame_cache_sector[frame] = sector;
+    frame_cache_next[frame]   = *head;
+    *head                     = frame;
+    frame_flags[frame]       |= PE_INFO_CACHED;
+    return true;
+}
+
+static void page_cache_remove(frame_t frame)
+{
+    if (!(frame_flags[frame] & PE_INFO_CACHED)) return;
+
+    frame_t *link = page_cache_bucket(frame_cache_sector[frame]);
+    while (*link != frame) link = &frame_cache_next[*link];
+    *link               = frame_cache_next[frame];
+    frame_flags[frame] &= ~PE_INFO_CACHED;
+}
+
+/* === Standby list === */
+
+/*
+ * Frames evicted by page_reclaim_thread() from a single mapping keep their
+ * contents on the standby list until the frame is needed, tagged with the
+ * pid and address the page was evicted from. A fault on the page takes the
+ * frame back without reading the page in again, a minor fault. Frames are
+ * taken off the list for reuse oldest first, once the free lists are
+ * empty.
+ *
+ * The list runs through frame_next_free and frame_prev_free. Frames are
+ * found through a hash on (pid, vaddr) chained through frame_cache_next,
+ * with the vaddr in frame_cache_sector, as a standby frame is never in the
+ * page cache. Only touched with interrupts disabled.
+ */
+static frame_t  standby[STANDBY_BUCKETS];
+static frame_t  standby_head = FRAME_NONE; /* newest */
+static frame_t  standby_tail = FRAME_NONE; /* oldest */
+static uint32_t standby_page_count;
+
+static inline frame_t *standby_bucket(uint32_t pid, uint32_t vaddr)
+{
+    return &standby[(vaddr / PAGE_SIZE + pid) % STANDBY_BUCKETS];
+}
+
+static void standby_push(frame_t frame, uint32_t pid, uint32_t vaddr)
+{
+    frame_t *head = standby_bucket(pid, vaddr);
+
+    frame_flags[frame]        = PE_INFO_STANDBY;
+    frame_standby_pid[frame]  = pid;
+    frame_cache_sector[frame] = vaddr;
+    frame_cache_next[frame]   = *head;
+    *head                     = frame;
+
+    frame_prev_free[frame] = FRAME_NONE;
+    frame_next_free[frame] = standby_head;
+    if (standby_head != FRAME_NONE) frame_prev_free[standby_head] = frame;
+    else standby_tail = frame;
+    standby_head = frame;
+    standby_page_count++;
+}
+
+static void standby_remove(frame_t frame)
+{
+    frame_t *link = standby_bucket(frame_standby_pid[frame], frame_cache_sector[frame]);
+    while (*link != frame) link = &frame_cache_next[*link];
+    *link = frame_cache_next[frame];
+
+    frame_t prev = frame_prev_free[frame], next = frame_next_free[frame];
+    if (prev != FRAME_NONE) frame_next_free[prev] = next;
+    else standby_head = next;
+    if (next != FRAME_NONE) frame_prev_free[next] = prev;
+    else standby_tail = prev;
+
+    frame_flags[frame] &= ~PE_INFO_STANDBY;
+    standby_page_count--;
+}
+
+/* Standby frame holding the page at 'vaddr' of 'pid', FRAME_NONE if none */
+static frame_t standby_lookup(uint32_t pid, uint32_t vaddr)
+{
+    frame_t frame = *standby_bucket(pid, vaddr);
+
+    while (frame != FRAME_NONE
+           && (frame_standby_pid[frame] != pid || frame_cache_sector[frame] != vaddr)) {
+        frame = frame_cache_next[frame];
+    }
+    return frame;
+}
+
+uint32_t pageable_page_count(void)
+{
+    return frame_count;
+}
 
-///////////////////////////////////////////////////////
-// similar (but static) datastructure as in INF1101
-// google-clone exam to link physical and virtual adresses
-//
-// python size calculation for 4GB mem system:
-// >>> GB = 1024**3
-// >>> page_size = 4*1024
-// >>> page_frame_info_size = 4*4 + 1
-// >>> ((4) - (4*GB - (4*GB/page_size)*2*page_frame_info_size)/(GB))*(1024)
-// 34.0
-//
-// i.e, the current info will use ~34 MB of memory
-// if everything is pageable and one assumes all memory
-// is shareable --> considerable optimization still possible
-///////////////////////////////////////////////////////
-
-
-/* === Info structure to keep track on pages condition === */
-
-struct page_frame_info {
-    pcb_t *owner;
-
-    // the next info frame like this sharing the same physical address
-    struct page_frame_info *next_shared_info;
-
-    // points to the next free page
-    // Note: If taken - is null.
-    // free a page index by physical address and insert
-    // into the linked list
-    struct page_frame_info *next_free_page;
-
-    uintptr_t *paddr;
-    uintptr_t *vaddr;
-    uint32_t   info_mode;
+/* CMOS registers holding the amount of extended memory in KB */
+enum {
+    CMOS_ADDR_PORT    = 0x70,
+    CMOS_DATA_PORT    = 0x71,
+    CMOS_EXT_MEM_LOW  = 0x30,
+    CMOS_EXT_MEM_HIGH = 0x31,
 };
-typedef struct page_frame_info page_frame_info_t;
 
-page_frame_info_t  page_frame_info[PAGEABLE_PAGES];
-page_frame_info_t  page_frame_info_shared[PAGEABLE_PAGES];
-page_frame_info_t *page_free_head;
+/*
+ * Returns the physical address where memory ends, as counted by the BIOS
+ * at power on. The CMOS keeps the amount of extended memory (above 1MB) in
+ * KB, which caps what we can see at 64MB, more than we can identity map
+ * below process space anyway.
+ */
+static uint32_t detect_memory_end(void)
+{
+    uint32_t kb;
+
+    outb(CMOS_ADDR_PORT, CMOS_EXT_MEM_LOW);
+    kb = inb(CMOS_DATA_PORT);
+    outb(CMOS_ADDR_PORT, CMOS_EXT_MEM_HIGH);
+    kb |= inb(CMOS_DATA_PORT) << 8;
 
-#define set_frame_info(frame, ownerv, next_shared_infov, paddrv, info_modev) \
-    { \
-        frame.owner            = ownerv; \
-        frame.next_shared_info = next_shared_infov; \
-        frame.paddr            = paddrv; \
-        frame.info_mode        = info_modev; \
+    if (kb == 0) {
+        pr_error("CMOS reports no extended memory, assuming 4MB\n");
+        return 0x400000;
     }
+    return 0x100000 + kb * 1024;
+}
 
 /*
- Initializes the array of page frame info structures representing the physical
- pages within a predefined memory region. This function sets up each page frame
- info structure with a sequential physical address, starting from a defined
- base, and links each to its subsequent frame to form a single-linked list of
- free page frames. It also initializes a parallel array for shared
- page frames, albeit without any owner or physical address, to be used for
- tracking shared page frame information.
-*/
-void initialize_page_frame_infos(void)
+ * Whether the page at 'paddr' is usable RAM according to 'map', that is
+ * inside a usable region and not overlapping any other. Without a map all
+ * memory up to the CMOS memory size is.
+ */
+static bool memory_map_usable(const struct memory_map *map, uint32_t paddr)
 {
-    uint32_t paddr = PAGING_AREA_MIN_PADDR;
+    bool usable = map->count == 0;
 
-    page_free_head = &page_frame_info[0];
-    set_frame_info(page_frame_info[0], NULL, NULL, (uintptr_t *) paddr, 0);
-    set_frame_info(page_frame_info_shared[0], NULL, NULL, NULL, 0);
+    for (uint32_t i = 0; i < map->count; i++) {
+        uint64_t start = map->entry[i].base;
+        uint64_t end   = start + map->entry[i].length;
 
-    for (int i = 1; i < PAGEABLE_PAGES; i++) {
-        paddr += PAGE_SIZE;
-        set_frame_info(
-                page_frame_info[i], NULL, NULL, (uintptr_t *) (paddr), 0
-        );
-        set_frame_info(page_frame_info_shared[i], NULL, NULL, NULL, 0);
+        if (map->entry[i].type == MEMORY_MAP_USABLE) {
+            if (start <= paddr && paddr + PAGE_SIZE <= end) usable = true;
+        } else if (start < paddr + PAGE_SIZE && paddr < end) {
+            return false;
+        }
+    }
+    return usable;
+}
+
+/* End of the highest usable region of memory we can page */
+static uint32_t memory_map_end(const struct memory_map *map)
+{
+    uint64_t mem_end = 0;
+
+    if (map->count == 0) return detect_memory_end();
 
-        page_frame_info[i - 1].next_free_page = &page_frame_info[i];
+    for (uint32_t i = 0; i < map->count; i++) {
+        const struct memory_map_entry *entry = &map->entry[i];
+        uint64_t end = entry->base + entry->length;
+
+        pr_info("memory map: 0x%08x%08x-0x%08x%08x type %u\n",
+                (uint32_t) (entry->base >> 32), (uint32_t) entry->base,
+                (uint32_t) (end >> 32), (uint32_t) end, entry->type);
+        if (entry->type == MEMORY_MAP_USABLE && end > mem_end) mem_end = end;
     }
-    page_frame_info[PAGEABLE_PAGES - 1].next_free_page = NULL;
+    return mem_end > PAGING_AREA_MAX_PADDR ? PAGING_AREA_MAX_PADDR : mem_end;
 }
 
 /*
-Adds a page frame, identified by its physical address, to the head of the
-global free page frame list and calculates the index of the page
-frame based on its physical address and then links it to the current head of
-the free list, making it the new head. It is the responsibility of the caller
-to ensure that access to this function is synchronized using the provided
-spinlock mechanisms to avoid race conditions.
+ * Sets up the frame table for the paging area, from past the kernel stacks
+ * up to the end of usable memory in 'map'. The table itself takes the first
+ * of those pages, the usable frames following it are linked into the free
+ * list.
+ * Holes in the map are kept out of it as reserved frames.
  */
-void add_page_frame_to_free_list_info(uintptr_t *paddress)
+static void frame_table_init(const struct memory_map *map)
 {
-    // Convert 'address' to its corresponding index in the free_pages array
-    int index = calculate_info_index(paddress);
+    uint32_t mem_end, pages, table_pages;
+
+    mem_end = MIN(memory_map_end(map), PAGING_AREA_MAX_PADDR) & PE_BASE_ADDR_MASK;
+    assertk(mem_end > next_free_mem);
+    pages       = (mem_end - next_free_mem) / PAGE_SIZE;
+    table_pages = (pages * FRAME_TABLE_ENTRY_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    frame_count = pages - table_pages;
+    if (PAGEABLE_PAGES_LIMIT && frame_count > PAGEABLE_PAGES_LIMIT) {
+        frame_count = PAGEABLE_PAGES_LIMIT;
+    }
+    assertk(frame_count < FRAME_NONE);
+
+    frame_flags     = alloc_memory(frame_count * sizeof(*frame_flags));
+    frame_rmap      = alloc_memory(frame_count * sizeof(*frame_rmap));
+    frame_swap_slot = alloc_memory(frame_count * sizeof(*frame_swap_slot));
+    frame_next_free = alloc_memory(frame_count * sizeof(*frame_next_free));
+    frame_prev_free = alloc_memory(frame_count * sizeof(*frame_prev_free));
+    frame_cache_sector = alloc_memory(frame_count * sizeof(*frame_cache_sector));
+    frame_cache_next   = alloc_memory(frame_count * sizeof(*frame_cache_next));
+    frame_standby_pid  = alloc_memory(frame_count * sizeof(*frame_standby_pid));
+    frame_last_use     = alloc_memory(frame_count * sizeof(*frame_last_use));
+    fifo_queue.queue = alloc_memory(frame_count * sizeof(*fifo_queue.queue));
+
+    frame_base      = (next_free_mem + PAGE_SIZE - 1) & PE_BASE_ADDR_MASK;
+    paging_area_end = frame_base + frame_count * PAGE_SIZE;
+
+    for (uint32_t i = 0; i < PAGE_CACHE_BUCKETS; i++) page_cache[i] = FRAME_NONE;
+    for (uint32_t i = 0; i < STANDBY_BUCKETS; i++) standby[i] = FRAME_NONE;
+
+    // backwards, so that the lowest frames are handed out first
+    for (uint32_t i = frame_count; i-- > 0;) {
+        frame_rmap[i]      = RMAP_NONE;
+        frame_swap_slot[i] = SWAP_NO_SLOT;
+        if (memory_map_usable(map, (uint32_t) frame_paddr(i))) {
+            add_page_frame_to_free_list_info(frame_paddr(i));
+        } else {
+            frame_flags[i] = PE_INFO_PINNED | PE_INFO_KERNEL_DUMMY;
+        }
+    }
 
-    page_frame_info_t *page_frame = &page_frame_info[index];
-    // Prepend this page_frame to the start of the free list
-    page_frame->next_free_page = page_free_head;
-    page_free_head = page_frame;
+    pr_info("%u pageable frames (%u usable) at 0x%08x-0x%08x, %u KB frame table\n",
+            frame_count, free_page_count, frame_base, paging_area_end,
+            table_pages * PAGE_SIZE / 1024);
 }
 
+/* === Kernel stacks === */
+
 /*
-Removes and returns the first page frame from the global free list of page
-frames. When a page frame is removed from the free list, the function updates the head of the list to the
-next page frame in the list and clears the 'next' pointer of the removed frame.
+ * Every task has a kernel stack of T_KSTACK_SIZE_EACH bytes, from an area
+ * reserved at the start of the paging area at boot with room for a stack
+ * per pcb. Stacks stay identity mapped, as drivers hand buffers on the
+ * stack to the USB controller. The page below each stack is a guard left
+ * out of the identity map, so that running off the end of a stack faults
+ * instead of overwriting the stack below it. As the guards are known
+ * before any page table is filled, no copy of the kernel tables maps them.
+ * Stacks of exited tasks go on a free list and are reused.
+ *
+ * A stack is filled with KSTACK_FILL when handed out, so how deep it has
+ * gone shows in how much of the pattern is left.
  */
-page_frame_info_t *remove_page_frame_from_free_list_info()
+enum {
+    KSTACK_PAGES     = T_KSTACK_SIZE_EACH / PAGE_SIZE,
+    KSTACK_SLOT_SIZE = (KSTACK_PAGES + 1) * PAGE_SIZE, /* with the guard */
+    KSTACK_AREA_SIZE = PCB_TABLE_SIZE * KSTACK_SLOT_SIZE,
+};
+#define KSTACK_FILL 0x57ac57ac
+
+_Static_assert(T_KSTACK_SIZE_EACH % PAGE_SIZE == 0, "kernel stacks are whole pages");
+// guard pages need 4KB mappings, and only the first 4MB have them with large pages
+_Static_assert(PAGING_AREA_MIN_PADDR + KSTACK_AREA_SIZE <= PTABLE_SPAN,
+               "kernel stacks must fit below 4MB");
+
+static uintptr_t kstack_area;      /* guard of the first stack */
+static uintptr_t kstack_free_list; /* linked through their lowest word */
+static uint32_t  kstack_count;     /* stacks handed out so far */
+static uint32_t  kstack_max_used;  /* deepest any stack has gone, in bytes */
+
+/* Reserve the kernel stack area off the start of the paging area */
+static void kstack_area_init(const struct memory_map *map)
 {
-    if (page_free_head == NULL) {
-        // No free page frames available
-        return NULL;
+    kstack_area = (uintptr_t) alloc_memory(KSTACK_AREA_SIZE);
+    assertk(kstack_area + KSTACK_AREA_SIZE <= PTABLE_SPAN);
+    for (uintptr_t paddr = kstack_area; paddr < kstack_area + KSTACK_AREA_SIZE;
+         paddr += PAGE_SIZE) {
+        assertf(memory_map_usable(map, paddr), "no RAM for kernel stacks at 0x%08x\n", paddr);
+    }
+    pr_info("%u KB of kernel stacks at 0x%08x\n", KSTACK_AREA_SIZE / 1024, kstack_area);
+}
+
+/* Is 'paddr' the guard page below a kernel stack? */
+static bool kstack_guard(uint32_t paddr)
+{
+    return kstack_area <= paddr && paddr < kstack_area + KSTACK_AREA_SIZE
+           && (paddr - kstack_area) % KSTACK_SLOT_SIZE < PAGE_SIZE;
+}
+
+uintptr_t kstack_alloc(void)
+{
+    nointerrupt_enter();
+    uintptr_t stack = kstack_free_list;
+    if (stack) {
+        kstack_free_list = *(uintptr_t *) stack;
+    } else if (kstack_count < PCB_TABLE_SIZE) {
+        stack = kstack_area + kstack_count++ * KSTACK_SLOT_SIZE + PAGE_SIZE;
+    }
+    nointerrupt_leave();
+
+    if (!stack) {
+        pr_error("out of kernel stacks\n");
+        return 0;
+    }
+    for (uint32_t *word = (uint32_t *) stack;
+         (uintptr_t) word < stack + T_KSTACK_SIZE_EACH; word++) {
+        *word = KSTACK_FILL;
+    }
+    return stack;
+}
+
+uint32_t kstack_high_water(uintptr_t stack)
+{
+    uint32_t *word = (uint32_t *) stack;
+
+    while ((uintptr_t) word < stack + T_KSTACK_SIZE_EACH && *word == KSTACK_FILL) word++;
+    return stack + T_KSTACK_SIZE_EACH - (uintptr_t) word;
+}
+
+void kstack_free(uintptr_t stack)
+{
+    uint32_t used = kstack_high_water(stack);
+
+    nointerrupt_enter();
+    bool deepest = used > kstack_max_used;
+    if (deepest) kstack_max_used = used;
+    *(uintptr_t *) stack = kstack_free_list;
+    kstack_free_list     = stack;
+    nointerrupt_leave();
+
+    if (deepest) {
+        pr_info("kernel stacks have used up to %u of %u bytes\n", used, T_KSTACK_SIZE_EACH);
+    }
+}
+
+/*
+ * Free frames are kept on two lists: those known to be zero, filled by
+ * page_zero_thread(), and the rest. The caller of the functions below has
+ * interrupts disabled.
+ */
+static inline frame_t *free_list_of(frame_t frame)
+{
+    return (frame_flags[frame] & PE_INFO_ZEROED) ? &frame_zero_head
+                                                 : &frame_free_head;
+}
+
+static void push_free_frame(frame_t frame, bool zeroed)
+{
+    frame_flags[frame] = PE_INFO_FREE | (zeroed ? PE_INFO_ZEROED : 0);
+
+    frame_t *head          = free_list_of(frame);
+    frame_prev_free[frame] = FRAME_NONE;
+    frame_next_free[frame] = *head;
+    if (*head != FRAME_NONE) frame_prev_free[*head] = frame;
+    *head = frame;
+
+    free_page_count++;
+    if (zeroed) zero_page_count++;
+}
+
+/* Adds the page frame 'paddr' to the head of the free list. */
+void add_page_frame_to_free_list_info(uintptr_t *paddr)
+{
+    push_free_frame(frame_index(paddr), false);
+}
+
+static void unlink_free_frame(frame_t frame)
+{
+    frame_t prev = frame_prev_free[frame], next = frame_next_free[frame];
+
+    if (prev != FRAME_NONE) frame_next_free[prev] = next;
+    else *free_list_of(frame) = next;
+    if (next != FRAME_NONE) frame_prev_free[next] = prev;
+
+    if (frame_flags[frame] & PE_INFO_ZEROED) zero_page_count--;
+    frame_flags[frame] &= ~(PE_INFO_FREE | PE_INFO_ZEROED);
+    free_page_count--;
+}
+
+/*
+ * Removes a page frame from the free lists and returns its physical
+ * address, or NULL if there are no free frames. Zeroed frames are handed
+ * out first if 'want_zeroed' is set and last otherwise. '*zeroed' tells
+ * which kind was returned. When both lists are empty the oldest standby
+ * frame gives up its page.
+ */
+uintptr_t *remove_page_frame_from_free_list_info(bool want_zeroed, bool *zeroed)
+{
+    frame_t first  = want_zeroed ? frame_zero_head : frame_free_head;
+    frame_t second = want_zeroed ? frame_free_head : frame_zero_head;
+    frame_t frame  = first != FRAME_NONE ? first : second;
+
+    if (frame == FRAME_NONE && standby_tail != FRAME_NONE) {
+        frame = standby_tail;
+        standby_remove(frame);
+        *zeroed = false;
+        return frame_paddr(frame);
     }
-    // Take the first page frame from the free list
-    page_frame_info_t *allocated_page_frame = page_free_head;
-    // Move head to the next frame
-    page_free_head = allocated_page_frame->next_free_page;
-    allocated_page_frame->next_free_page = NULL;
-    return allocated_page_frame;
+    if (frame == FRAME_NONE) return NULL;
+
+    *zeroed = frame_flags[frame] & PE_INFO_ZEROED;
+    unlink_free_frame(frame);
+    return frame_paddr(frame);
 }
 
 /*
- * "Hashing" function carrying physical page addresses into the info struct
- * array
+ * Takes a run of up to '*npages' physically contiguous free frames off the
+ * free lists, for a read ahead that goes into one buffer. Every free frame
+ * is tried as the start of the run, and the longest run found is taken.
+ * Returns its first frame and sets '*npages' to its length, or returns NULL
+ * if no two free frames are next to each other.
  */
-uint32_t calculate_info_index(uintptr_t *paddr)
+static uintptr_t *take_free_frame_run(uint32_t *npages)
 {
-    return ((uint32_t) paddr - PAGING_AREA_MIN_PADDR) / PAGE_SIZE;
+    frame_t  heads[] = {frame_free_head, frame_zero_head};
+    frame_t  best    = FRAME_NONE;
+    uint32_t best_n  = 1;
+
+    for (int l = 0; l < 2 && best_n < *npages; l++) {
+        for (frame_t f = heads[l]; f != FRAME_NONE && best_n < *npages;
+             f = frame_next_free[f]) {
+            uint32_t n = 1;
+            while (n < *npages && f + n < frame_count && (frame_flags[f + n] & PE_INFO_FREE)) {
+                n++;
+            }
+            if (n > best_n) {
+                best   = f;
+                best_n = n;
+            }
+        }
+    }
+    if (best == FRAME_NONE) return NULL;
+
+    for (uint32_t i = 0; i < best_n; i++) unlink_free_frame(best + i);
+    *npages = best_n;
+    return frame_paddr(best);
 }
 
+/* === Reverse mappings === */
+
 /*
- * Insert or update page frame information in the info arrays.
+ * Every mapping of a frame, the main one included, takes an entry from a
+ * pool with a free list, so taking and returning one is O(1). Further
+ * mappings of a shared frame are linked in right after the main one. The
+ * pool grows by a pinned kernel page at a time, so the number of mappings
+ * isn't bounded by the number of frames. Pool pages are never given back.
+ *
+ * The pool is only touched with interrupts disabled.
  */
-page_frame_info_t *insert_page_frame_info(
-        uintptr_t *paddr,
-        uintptr_t *vaddr,
-        pcb_t     *owner_pcb,
-        uint32_t   info_mode
-)
+struct rmap {
+    pcb_t   *owner;
+    uint32_t vaddr;
+    rmap_t   next; /* next mapping of the frame, or next free entry */
+};
+
+enum {
+    RMAP_PER_PAGE       = PAGE_SIZE / sizeof(struct rmap),
+    RMAP_POOL_MAX_PAGES = 0xffff / RMAP_PER_PAGE,
+};
+
+static struct rmap *rmap_pool[RMAP_POOL_MAX_PAGES];
+static uint32_t     rmap_pool_pages;
+static rmap_t       rmap_free_head = RMAP_NONE;
+
+static inline struct rmap *rmap_entry(rmap_t r)
+{
+    return &rmap_pool[r / RMAP_PER_PAGE][r % RMAP_PER_PAGE];
+}
+
+static void rmap_release(rmap_t r)
+{
+    struct rmap *map = rmap_entry(r);
+    // user pages count toward the resident set, page tables don't
+    if (map->owner && map->vaddr >= PROCESS_VADDR) map->owner->rss--;
+    map->owner       = NULL;
+    map->vaddr       = 0;
+    map->next        = rmap_free_head;
+    rmap_free_head   = r;
+}
+
+static rmap_t rmap_alloc(void)
+{
+    rmap_t r = rmap_free_head;
+    if (r != RMAP_NONE) rmap_free_head = rmap_entry(r)->next;
+    return r;
+}
+
+/*
+ * Carve a new page into rmap entries. Can evict. The page is pinned but has
+ * no mapping of its own, that would need an entry from the pool.
+ */
+static void rmap_pool_grow(void)
+{
+    struct rmap *pool = (struct rmap *) allocate_page();
+    inc_pinned_pages(1);
+
+    nointerrupt_enter();
+    frame_flags[frame_index((uintptr_t *) pool)] =
+            PE_INFO_PINNED | PE_INFO_KERNEL_DUMMY;
+
+    if (rmap_pool_pages == RMAP_POOL_MAX_PAGES) {
+        pr_error("out of reverse mapping entries\n");
+        abortk();
+    }
+    uint32_t page        = rmap_pool_pages++;
+    rmap_pool[page]      = pool;
+    for (uint32_t i = 0; i < RMAP_PER_PAGE; i++) {
+        rmap_t r = page * RMAP_PER_PAGE + i;
+        if (r != RMAP_NONE) rmap_release(r);
+    }
+    if (MEMDEBUG) pr_log("rmap pool grown to %u pages\n", rmap_pool_pages);
+    nointerrupt_leave();
+}
+
+/* Takes an entry off the rmap pool. Can evict, so no vmem_lock may be held. */
+static rmap_t rmap_get(void)
+{
+    rmap_t r;
+
+    nointerrupt_enter();
+    while ((r = rmap_alloc()) == RMAP_NONE) {
+        // growing the pool may evict, which needs interrupts
+        nointerrupt_leave();
+        rmap_pool_grow();
+        nointerrupt_enter();
+    }
+    nointerrupt_leave();
+    return r;
+}
+
+/* Gives back an entry from rmap_get() that was not linked after all */
+static void rmap_put(rmap_t r)
 {
-    uint32_t           index = calculate_info_index(paddr);
-    page_frame_info_t *info  = &page_frame_info[index];
+    nointerrupt_enter();
+    rmap_release(r);
+    nointerrupt_leave();
+}
 
+/*
+ * Links entry 'r' into 'frame' as its mapping at 'vaddr' in 'owner'. The
+ * first mapping of a frame sets its PE_INFO_* flags to 'info_mode'. The
+ * caller has interrupts disabled.
+ */
+static void rmap_link(frame_t frame, rmap_t r, pcb_t *owner, uint32_t vaddr, uint32_t info_mode)
+{
+    struct rmap *map = rmap_entry(r);
+    map->owner       = owner;
     // align vaddr to lower (virtual) page boundary
-    vaddr = (uint32_t *) (((uint32_t) vaddr) & 0xfffff000);
+    map->vaddr       = vaddr & PE_BASE_ADDR_MASK;
+    if (map->vaddr >= PROCESS_VADDR) owner->rss++;
 
-    // If the page frame is already occupied, manage the shared info structure.
-    if (info->owner) {
+    // If the page frame is already occupied, link in a shared mapping.
+    if (frame_rmap[frame] != RMAP_NONE) {
+        struct rmap *main = rmap_entry(frame_rmap[frame]);
         if (MEMDEBUG) {
-                pr_log(
+            pr_log(
                     "Shared page at physical address %u, already occupied by PID "
                     "%u",
-                    (uint32_t) paddr, info->owner->pid
+                    (uint32_t) frame_paddr(frame), main->owner->pid
             );
         }
+        map->next  = main->next;
+        main->next = r;
+    } else {
+        map->next          = RMAP_NONE;
+        frame_rmap[frame]     = r;
+        frame_flags[frame]    = info_mode;
+        frame_last_use[frame] = virtual_msecs(owner);
+    }
+}
 
-        if ( !(info->owner -> is_thread) ) {
-            assertk(PAGING_AREA_MIN_PADDR <= (uintptr_t) vaddr && (uintptr_t) vaddr < PAGING_AREA_MAX_PADDR);
+/*
+ * Takes the mapping of 'frame' at 'vaddr' in 'owner' off its chain and
+ * returns it, or RMAP_NONE if there is none. It still counts toward the
+ * owner's resident set until released. The caller has interrupts
+ * disabled.
+ */
+static rmap_t rmap_unlink(frame_t frame, pcb_t *owner, uint32_t vaddr)
+{
+    for (rmap_t *link = &frame_rmap[frame]; *link != RMAP_NONE;
+         link = &rmap_entry(*link)->next) {
+        struct rmap *map = rmap_entry(*link);
+        if (map->owner == owner && map->vaddr == vaddr) {
+            rmap_t r = *link;
+            *link    = map->next;
+            return r;
         }
+    }
+    return RMAP_NONE;
+}
 
-        // Traverse to the last info struct in the chain.
-        page_frame_info_t *last_info = info;
-        while (last_info->next_shared_info) {
-            last_info = last_info->next_shared_info;
-        }
+/*
+ * Records that 'paddr' is mapped at 'vaddr' in 'owner_pcb'. The first
+ * mapping of a frame sets its PE_INFO_* flags to 'info_mode'.
+ */
+void insert_page_frame_info(
+        uintptr_t *paddr,
+        uintptr_t *vaddr,
+        pcb_t     *owner_pcb,
+        uint32_t   info_mode
+)
+{
+    rmap_t r = rmap_get();
 
-        // Try to find a free slot in the shared info array.
-        for (int i = 0; i < PAGEABLE_PAGES; ++i) {
-            page_frame_info_t *shared_info = &page_frame_info_shared[i];
-            if (!shared_info->owner) {
-                last_info->next_shared_info = shared_info;
-                shared_info->owner          = owner_pcb;
-                shared_info->paddr          = paddr;
-                shared_info->vaddr          = vaddr;
-                shared_info->info_mode      = info_mode;
-                return shared_info;
-            }
-        }
-        // No suitable slot found for the new page info.
-        nointerrupt_enter();
-        pr_error(
-                "No available shared info slots for physical address %u",
-                (uint32_t) paddr
-        );
-        nointerrupt_leave();
-        return NULL;
-    } else {
-        // If the page is not occupied, initialize the main info struct.
-        info->owner            = owner_pcb;
-        info->next_shared_info = NULL;
-        info->vaddr            = vaddr;
-        info->info_mode        = info_mode;
-        return info;
-    }
+    nointerrupt_enter();
+    rmap_link(frame_index(paddr), r, owner_pcb, (uint32_t) vaddr, info_mode);
+    nointerrupt_leave();
 }
 
 static spinlock_t pinned_pages_counter_lock = SPINLOCK_INIT;
@@ -292,23 +843,6 @@ void inc_pinned_pages(int increment)
 }
 
 /* === Info structure to keep track on fifo queue === */
-typedef struct {
-    uint32_t next_in, next_out;
-    uint32_t queue[PAGEABLE_PAGES];
-    uint32_t items;
-} FIFOQueue;
-
-static FIFOQueue fifo_queue;
-
-void fifo_init()
-{
-    fifo_queue.next_in  = 0;
-    fifo_queue.next_out = 0;
-    fifo_queue.items    = 0;
-    for (int i = 0; i < PAGEABLE_PAGES; i++) {
-        fifo_queue.queue[i] = 0;
-    }
-}
 
 bool fifo_is_empty()
 {
@@ -317,13 +851,7 @@ bool fifo_is_empty()
 
 bool fifo_is_full()
 {
-    return (fifo_queue.next_in + 1) % PAGEABLE_PAGES == fifo_queue.next_out;
-    // bool is_full;
-    // spinlock_acquire(&pinned_pages_counter_lock);
-    // is_full =
-    //         fifo_queue.items == PAGEABLE_PAGES - number_of_pinned_page_frames;
-    // spinlock_release(&pinned_pages_counter_lock);
-    // return is_full;
+    return (fifo_queue.next_in + 1) % frame_count == fifo_queue.next_out;
 }
 
 bool fifo_enqueue(uint32_t item)
@@ -332,7 +860,7 @@ bool fifo_enqueue(uint32_t item)
         return false;
     }
     fifo_queue.queue[fifo_queue.next_in] = item;
-    fifo_queue.next_in = (fifo_queue.next_in + 1) % PAGEABLE_PAGES;
+    fifo_queue.next_in = (fifo_queue.next_in + 1) % frame_count;
     fifo_queue.items++;
     return true;
 }
@@ -344,7 +872,7 @@ uint32_t fifo_dequeue(int *error)
         *error = 1; // Indicates queue is empty
     }
     uint32_t item       = fifo_queue.queue[fifo_queue.next_out];
-    fifo_queue.next_out = (fifo_queue.next_out + 1) % PAGEABLE_PAGES;
+    fifo_queue.next_out = (fifo_queue.next_out + 1) % frame_count;
     fifo_queue.items--;
     if (MEMDEBUG) pr_log("fifo_dequeue next.out index = %u\n", fifo_queue.next_out);
 
@@ -353,11 +881,9 @@ uint32_t fifo_dequeue(int *error)
 
 void fifo_enqueue_info(uint32_t *paddr)
 {
-    
-    uint32_t info_index = calculate_info_index(paddr);
-    int      pinned = page_frame_info[info_index].info_mode & PE_INFO_PINNED;
-    if (!pinned) {
-        fifo_enqueue(info_index);
+    frame_t frame = frame_index(paddr);
+    if (!(frame_flags[frame] & PE_INFO_PINNED)) {
+        fifo_enqueue(frame);
     }
 }
 
@@ -368,42 +894,51 @@ uint32_t *fifo_dequeue_info(int *error)
         return NULL;
     }
 
-    uint32_t *paddr = page_frame_info[fifo_index].paddr;
-    return paddr;
+    return frame_paddr(fifo_index);
 }
 
 
 
+/* Zero a page frame with a single string instruction */
+static inline void page_zero(uint32_t *paddr)
+{
+    uint32_t count = PAGE_N_ENTRIES;
+    asm inline volatile(
+            "cld\n"
+            "rep stosl\n"
+            : "+D"(paddr), "+c"(count)
+            : "a"(0)
+            : "memory"
+    );
+}
+
 /*
- *  Allocates a page of memory by removing a page_info_frame from the list
+ *  Allocates a page of memory by removing a page frame from the lists
  *  of free pages and returning a pointer of it to the user.
+ *  Pages that are about to be overwritten by a disk read need no zeroing,
+ *  the others are taken from the pool of pre-zeroed frames if possible.
  */
-uint32_t *allocate_page_internal()
+uint32_t *allocate_page_internal(bool zero)
 {
-    uint32_t *paddr = NULL;
-    page_frame_info_t *page_info_frame =
-            remove_page_frame_from_free_list_info();
+    bool zeroed = false;
 
-    // zero out the page
-    if (page_info_frame) {
-        paddr = page_info_frame->paddr;
-        for (int i = 0; i < PAGE_SIZE; i++) {
-            *(paddr + i) = 0;
-        }
-    }
+    nointerrupt_enter();
+    uint32_t *paddr = remove_page_frame_from_free_list_info(zero, &zeroed);
+    nointerrupt_leave();
+
+    if (paddr && zero && !zeroed) page_zero(paddr);
     return paddr;
 }
 
-uint32_t *allocate_page()
+static uint32_t *allocate_frame(bool zero)
 {
-    uint32_t *paddr = allocate_page_internal();
+    uint32_t *paddr = allocate_page_internal(zero);
     if (paddr == NULL) {
         // page table full, evict
-        nointerrupt_enter();
         if (MEMDEBUG) pr_log("allocate_page: page table full, evicting page\n");
         paddr = try_evict_page();
         if (MEMDEBUG) pr_log("allocate_page: evicted page frame %p\n", paddr);
-        nointerrupt_leave();
+        if (paddr && zero) page_zero(paddr);
     }
     if (!paddr) {
         nointerrupt_enter();
@@ -418,113 +953,287 @@ uint32_t *allocate_page()
     return paddr;
 }
 
-void page_clear_info(uintptr_t *paddr)
+uint32_t *allocate_page()
 {
-    page_frame_info_t *info_frame, *next_shared_info;
-    uint32_t           info_index = calculate_info_index(paddr);
-    info_frame                    = &page_frame_info[info_index];
+    return allocate_frame(true);
+}
 
-    // reset the frame to initial state
-    do {
-        info_frame->owner     = NULL;
-        info_frame->vaddr     = NULL;
-        info_frame->info_mode = 0;
+uint32_t *allocate_kernel_page(void)
+{
+    uint32_t *paddr = allocate_page();
+    insert_page_frame_info(paddr, paddr, dummy_kernel_pcb, PE_INFO_PINNED | PE_INFO_KERNEL_DUMMY);
+    inc_pinned_pages(1);
+    return paddr;
+}
+
+/*
+ * Keeps up to ZERO_POOL_PAGES free frames zeroed, so that allocations
+ * wanting a zeroed page don't have to clear one on the fault path. A frame
+ * is off the free lists while it is being cleared, with interrupts on.
+ */
+void page_zero_thread(void)
+{
+    while (1) {
+        uint32_t *paddr = NULL;
+
+        nointerrupt_enter();
+        if (zero_page_count < ZERO_POOL_PAGES && frame_free_head != FRAME_NONE) {
+            frame_t frame = frame_free_head;
+            unlink_free_frame(frame);
+            paddr = frame_paddr(frame);
+        }
+        nointerrupt_leave();
+
+        if (!paddr) {
+            msleep(ZERO_THREAD_SLEEP);
+            continue;
+        }
+
+        page_zero(paddr);
+
+        nointerrupt_enter();
+        push_free_frame(frame_index(paddr), true);
+        nointerrupt_leave();
+        yield();
+    }
+}
+
+void page_clear_info(uintptr_t *paddr)
+{
+    frame_t frame = frame_index(paddr);
+    rmap_t  r, next;
 
-        // transfer to next shared info frame
-        next_shared_info             = info_frame->next_shared_info;
-        info_frame->next_shared_info = NULL;
-        info_frame                   = next_shared_info;
-    } while (info_frame);
+    // reset the frame to initial state
+    nointerrupt_enter();
+    page_cache_remove(frame);
+    for (r = frame_rmap[frame]; r != RMAP_NONE; r = next) {
+        next = rmap_entry(r)->next;
+        rmap_release(r);
+    }
+    frame_rmap[frame]  = RMAP_NONE;
+    frame_flags[frame] = 0;
+    nointerrupt_leave();
 }
 
+enum {
+    PAGE_FREE_RELEASE = 0, /* put the frame on the free list */
+    PAGE_FREE_EVICT   = 1, /* hand the frame back to the caller */
+    PAGE_FREE_STANDBY = 2, /* keep the page on the standby list if it can */
+};
+
+/*
+ * Releases the page frame 'paddr' from all processes using it.
+ *
+ * If 'evict' is set the frame was picked for eviction and its page table
+ * entries are marked PE_BUSY. They are pointed to where the page can be
+ * found again, and processes waiting for the page are woken. With
+ * PAGE_FREE_EVICT the frame is handed back to the caller. With
+ * PAGE_FREE_STANDBY a page with a single mapping goes on the standby list
+ * before the entry stops being busy, and other frames are freed.
+ *
+ * The frame's reference to its swap slot passes on to the page table
+ * entries left pointing at it, or is dropped if there are none.
+ */
 void page_free(uintptr_t *paddr, int evict)
 {
-    page_frame_info_t *info_frame, *next_shared_info;
+    frame_t  frame = frame_index(paddr);
+    rmap_t   r, next;
+    uint32_t swapped = 0;
+    bool     standby;
 
-    uint32_t info_index = calculate_info_index(paddr);
-    info_frame          = &page_frame_info[info_index];
+    // take the mappings off the frame, so nothing finds them while they are
+    // being torn down
+    nointerrupt_enter();
+    page_cache_remove(frame);
+    int swap_slot          = frame_swap_slot[frame];
+    frame_swap_slot[frame] = SWAP_NO_SLOT;
+    r                      = frame_rmap[frame];
+    frame_rmap[frame]      = RMAP_NONE;
+    standby = evict == PAGE_FREE_STANDBY && r != RMAP_NONE && rmap_entry(r)->next == RMAP_NONE;
+    nointerrupt_leave();
 
-    // reset the frame to initial state
     uint32_t vaddr;
-    do {
-        if (info_frame->owner == dummy_kernel_pcb
-            || info_frame->owner->page_directory == kernel_pdir) {
+    for (; r != RMAP_NONE; r = next) {
+        struct rmap *map   = rmap_entry(r);
+        pcb_t       *owner = map->owner;
+        if (owner == dummy_kernel_pcb || owner->page_directory == kernel_pdir) {
             nointerrupt_enter();
             pr_error("tried to free a kernel page, aborting!!");
             nointerrupt_leave();
             abortk();
         }
-        vaddr = (uint32_t) info_frame->vaddr;
+        vaddr = map->vaddr;
 
-        nointerrupt_enter();
         if (evict) {
-            // unmaps the page and invalidates it
-            unmap_physical_page(info_frame->owner->page_directory, vaddr);
-        } else {
-            //spinlock_acquire(&page_frame_info_lock);
-            add_page_frame_to_free_list_info(paddr);
-            //spinlock_release(&page_frame_info_lock);
+            lock_acquire(&owner->vmem_lock);
+            nointerrupt_enter();
+            // unmaps the page and invalidates it, this also clears PE_BUSY
+            unmap_physical_page(owner->page_directory, vaddr);
+            if (swap_slot != SWAP_NO_SLOT) {
+                page_set_swapped(owner->page_directory, vaddr, swap_slot);
+                if (swapped++) swap_dup(swap_slot);
+            }
+            // a fault on the page finds it from here on
+            if (standby) standby_push(frame, owner->pid, vaddr);
+            nointerrupt_leave();
+            condition_broadcast(&owner->vmem_busy);
+            lock_release(&owner->vmem_lock);
         }
+
+        nointerrupt_enter();
+        next = map->next;
+        rmap_release(r);
         nointerrupt_leave();
+    }
 
-        info_frame->owner     = NULL;
-        info_frame->vaddr     = NULL;
-        info_frame->info_mode = 0;
-
-        // transfer to next shared info frame
-        next_shared_info             = info_frame->next_shared_info;
-        info_frame->next_shared_info = NULL;
-        info_frame                   = next_shared_info;
-    } while (info_frame);
-}
-
-// current bug: locks cause process to skip scheduler entry or return from it
-// solution is probably to use a cleaner thread/daemon like suggested in Tanenbaum MOS.
-// void free_done_process_memory(pcb_t *p) 
-// {
-//     // uint32_t table_index, dir_index, vaddr, *table;
-//     // uint32_t dir_entry, table_entry, old_mode;
-//     // // the quick and dirty way - linear search through entire pageable area,
-//     // // mark all pages belonging to this process as not pinned.
-//     // lock_acquire(&page_map_lock);
-//     // for (int i=0; i < PAGEABLE_PAGES; i++) {
-//     //     if (page_frame_info[i].owner == p) {
-// 
-//     //         
-//     //         // slight modification of page_set_mode to instead just clear dirty  bit,
-//     //         // because we don't want to write pages of finished processes to disc.
-//     //         // #################################################################
-//     //         // vaddr = (uint32_t) page_frame_info[i].vaddr;
-//     //         // dir_index = get_directory_index(vaddr);
-//     //         // table_index = get_table_index((uint32_t) vaddr);
-// 
-//     //         // // table_index = get_table_index(vaddr);
-//     //         // // table = p -> page_directory[dir_index] & PE_BASE_ADDR_MASK;
-// 
-//     //         // dir_entry = p->page_directory[dir_index];
-//     //         // assertk(dir_entry & PE_P); /* dir entry present */
-//     //         // table = (uint32_t *) (dir_entry & PE_BASE_ADDR_MASK);
-//     //         // table_entry = table[table_index];
-// 
-//     //         // /* set table[index] bits 11..0 */
-//     //         // old_mode = table_entry & PE_BASE_ADDR_MASK;
-//     //         // table_entry |= (old_mode & ~(PE_D)) & ~PE_BASE_ADDR_MASK;
-//     //         // table[table_index] = table_entry;
-//     //         // // #################################################################
-// 
-// 
-//     //         // put pinned pages to the fifo-queue so that they become available
-//     //         // for paging/swapping.
-//     //         if (page_frame_info[i].info_mode & PE_INFO_PINNED) {
-//     //             fifo_enqueue(i);
-//     //             page_frame_info[i].info_mode &=~(PE_INFO_PINNED);
-//     //         }
-//     //         // unpin the page frame, page fault handler can now swap it when added to the fifo queue
-//     //         //page_frame_info[i].info_mode &=~(PE_INFO_PINNED | PE_INFO_KERNEL_DUMMY | PE_INFO_USER_MODE);
-//     //     }
-//     // }
-//     // lock_release(&page_map_lock);
-// }
+    nointerrupt_enter();
+    if (swap_slot != SWAP_NO_SLOT && !swapped) swap_free(swap_slot);
+    // a standby frame may already have been taken back or reused
+    if (!standby) {
+        frame_flags[frame] = 0;
+        if (evict != PAGE_FREE_EVICT) add_page_frame_to_free_list_info(paddr);
+    }
+    nointerrupt_leave();
+}
+
+/* Take 'item' out of the FIFO queue wherever it is, keeping the rest in order */
+static void fifo_remove(uint32_t item)
+{
+    uint32_t in = fifo_queue.next_out, out = in, n = fifo_queue.items;
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t next = fifo_queue.queue[in];
+        in            = (in + 1) % frame_count;
+        if (next == item) {
+            fifo_queue.items--;
+            continue;
+        }
+        fifo_queue.queue[out] = next;
+        out                   = (out + 1) % frame_count;
+    }
+    fifo_queue.next_in = out;
+}
+
+/* Free the frame of a user page nobody maps any more */
+static void frame_release(frame_t frame)
+{
+    // page_clean() may still be writing it to swap
+    nointerrupt_enter();
+    while (frame_flags[frame] & PE_INFO_IN_TRANSIT) {
+        nointerrupt_leave();
+        yield();
+        nointerrupt_enter();
+    }
+    if (EVICTION_STRATEGY == EVICTION_STRATEGY_FIFO) fifo_remove(frame);
+    nointerrupt_leave();
+
+    page_free(frame_paddr(frame), PAGE_FREE_RELEASE);
+}
+
+/*
+ * Releases the address space of the exited process 'p': the frames of its
+ * resident pages, the swap slots of its evicted ones, its frames on the
+ * standby list and finally its page tables and directory. Pages shared
+ * with other processes only lose the mapping. Called by the reaper thread
+ * once 'p' can no longer run, so only evictions started before it exited
+ * can be in the way.
+ */
+void free_process_vmem(pcb_t *p)
+{
+    uint32_t *pdir  = p->page_directory;
+    uint32_t  first = get_directory_index(PROCESS_VADDR);
+    uint32_t  frames = 0, slots = 0;
+
+    if (p->is_thread) return;
+
+    // the slots its evicted page tables refer to are freed below
+    for (uint32_t i = first; i < PAGE_N_ENTRIES; i++) {
+        if (pdir[i] & (PE_SWAPPED | PE_BUSY)) ptable_fault_in(p, i << PAGE_DIRECTORY_BITS);
+    }
+
+    lock_acquire(&p->vmem_lock);
+    for (uint32_t i = first; i < PAGE_N_ENTRIES; i++) {
+        if (!(pdir[i] & PE_P)) continue;
+
+        uint32_t *table = (uint32_t *) (pdir[i] & PE_BASE_ADDR_MASK);
+        for (uint32_t index = 0; index < PAGE_N_ENTRIES; index++) {
+            uint32_t vaddr = (i << PAGE_DIRECTORY_BITS) | (index << PAGE_TABLE_BITS);
+
+            // a page on its way to or from swap is released once it settles
+            nointerrupt_enter();
+            while (table[index] & PE_BUSY) {
+                nointerrupt_leave();
+                condition_wait(&p->vmem_lock, &p->vmem_busy);
+                nointerrupt_enter();
+            }
+
+            uint32_t   entry = table[index];
+            uintptr_t *paddr = (uintptr_t *) (entry & PE_BASE_ADDR_MASK);
+            bool       last  = false;
+            table[index]     = 0;
+            if (!(entry & PE_P)) {
+                if (entry & PE_SWAPPED) {
+                    swap_free(entry >> PE_BASE_ADDR_BITS);
+                    slots++;
+                }
+            } else if (paddr != shared_zero_page) {
+                frame_t frame = frame_index(paddr);
+                rmap_t  r     = rmap_unlink(frame, p, vaddr);
+                if (r != RMAP_NONE) rmap_release(r);
+                last = frame_rmap[frame] == RMAP_NONE;
+            }
+            nointerrupt_leave();
+
+            if (last) {
+                frame_release(frame_index(paddr));
+                frames++;
+            }
+        }
+    }
+    lock_release(&p->vmem_lock);
+
+    // its pages on standby can't be faulted back in any more
+    nointerrupt_enter();
+    for (frame_t frame = standby_head, next; frame != FRAME_NONE; frame = next) {
+        next = frame_next_free[frame];
+        if (frame_standby_pid[frame] != p->pid) continue;
+
+        standby_remove(frame);
+        frame_flags[frame] = 0;
+        add_page_frame_to_free_list_info(frame_paddr(frame));
+        frames++;
+    }
+    nointerrupt_leave();
+
+    // What is left are its page tables and directory, pinned and mapped by
+    // it alone. The tables were emptied above, clear the rest so that they
+    // all go back zeroed, ready for the next process to take.
+    if (!PROCESSES_SHARE_KERNEL_PAGE_TABLE) {
+        for (uint32_t i = 0; i < first; i++) {
+            if ((pdir[i] & PE_P) && !(pdir[i] & PE_PS)) {
+                page_zero((uint32_t *) (pdir[i] & PE_BASE_ADDR_MASK));
+            }
+        }
+    }
+    page_zero(pdir);
+    for (frame_t frame = 0; frame < frame_count; frame++) {
+        nointerrupt_enter();
+        bool own = frame_rmap[frame] != RMAP_NONE && (frame_flags[frame] & PE_INFO_PINNED)
+                   && rmap_entry(frame_rmap[frame])->owner == p;
+        nointerrupt_leave();
+        if (!own) continue;
+
+        page_clear_info(frame_paddr(frame));
+        nointerrupt_enter();
+        push_free_frame(frame, true);
+        nointerrupt_leave();
+        inc_pinned_pages(-1);
+        frames++;
+    }
+    p->page_directory = NULL;
+
+    pr_debug("pid %u exited, freed %u frames and %u swap slots\n", p->pid, frames, slots);
+}
 
 
 void free_memory(uint32_t ptr)
@@ -589,8 +1298,12 @@ dir_ins_table(uint32_t *directory, uint32_t vaddr, void *table, uint32_t mode)
     directory[index] = (taddr & PE_BASE_ADDR_MASK) | access;
 }
 
-/* Set 12 least significant bytes in a page table entry to 'mode' */
-static inline void page_set_mode(uint32_t *pdir, uint32_t vaddr, uint32_t mode)
+/*
+ * Set 12 least significant bytes in a page table entry to 'mode', flushing
+ * the TLB entry for it if 'flush' is set
+ */
+static inline void
+page_set_entry(uint32_t *pdir, uint32_t vaddr, uint32_t mode, int flush)
 {
     uint32_t dir_index = get_directory_index((uint32_t) vaddr),
              index     = get_table_index((uint32_t) vaddr), dir_entry, *table,
@@ -604,10 +1317,27 @@ static inline void page_set_mode(uint32_t *pdir, uint32_t vaddr, uint32_t mode)
     entry |= mode & ~PE_BASE_ADDR_MASK;
     table[index] = entry;
     /* Flush TLB */
-    invalidate_page((uint32_t *) vaddr);
+    if (flush) invalidate_page((uint32_t *) vaddr);
     //if (pdir == current_running -> page_directory) invalidate_page((uint32_t *) vaddr);
 }
 
+/* Set 12 least significant bytes in a page table entry to 'mode' */
+static inline void page_set_mode(uint32_t *pdir, uint32_t vaddr, uint32_t mode)
+{
+    page_set_entry(pdir, vaddr, mode, 1);
+}
+
+/*
+ * Record in a non-present page table entry that the page is stored in swap
+ * slot 'slot'. The slot number replaces the base address.
+ */
+static void page_set_swapped(uint32_t *pdir, uint32_t vaddr, int slot)
+{
+    uint32_t *entry = get_page_table_entry(vaddr, pdir);
+    assertk(entry && !(*entry & PE_P));
+    *entry = ((uint32_t) slot << PE_BASE_ADDR_BITS) | PE_SWAPPED;
+}
+
 /* Debug-function.
  * Write all memory addresses and values by with 4 byte increment to
  * output-file. Output-file name is specified in bochsrc-file by line:
@@ -660,7 +1390,10 @@ const char *decode_info_mode(uint32_t info_mode)
     if (info_mode & PE_INFO_USER_MODE) strcat(buffer, "USER ");
     if (info_mode & PE_INFO_KERNEL_DUMMY) strcat(buffer, "KERNEL ");
     if (info_mode & PE_INFO_PINNED) strcat(buffer, "PINNED ");
-    if (info_mode & PE_INFO_STACK) strcat(buffer, "STACK");
+    if (info_mode & PE_INFO_STACK) strcat(buffer, "STACK ");
+    if (info_mode & PE_INFO_PREFETCHED) strcat(buffer, "PREFETCHED ");
+    if (info_mode & PE_INFO_IN_TRANSIT) strcat(buffer, "IN_TRANSIT ");
+    if (info_mode & PE_INFO_CACHED) strcat(buffer, "CACHED");
 
     if (buffer[0] == '\0') return "NONE";
     return buffer;
@@ -677,31 +1410,26 @@ void print_page_table_info(void)
     );
     pr_log("------------------------------------------------------------------------------------\n");
 
-    for (int i = 0; i < PAGEABLE_PAGES; i++) {
-        page_frame_info_t *info = &page_frame_info[i];
+    // free frames are only counted, there can be thousands of them
+    for (uint32_t i = 0; i < frame_count; i++) {
+        if (frame_flags[i] & PE_INFO_FREE) continue;
 
-        // Check if the page frame is used
-        if (info->owner != NULL) {
-            uint32_t owner_pid = info->owner->pid; 
+        if (frame_rmap[i] != RMAP_NONE) {
+            struct rmap *map = rmap_entry(frame_rmap[i]);
             pr_log(
                     "%-5d | %-12u | 0x%013x | 0x%013x | %-20s\n", 
-                    i, owner_pid, (uint32_t) info->vaddr, (uint32_t) info->paddr,
-                    decode_info_mode(info->info_mode)
-            );
-        } else if (info->next_free_page != NULL) {
-            // If the page is free, indicate as such
-            pr_log(
-                    "%-5d | %-12s | %-15s | 0x%013x | %-20s\n", 
-                    i, "FREE NEXT", "", (uint32_t) info->paddr, decode_info_mode(info->info_mode)
+                    i, map->owner->pid, map->vaddr, (uint32_t) frame_paddr(i),
+                    decode_info_mode(frame_flags[i])
             );
         } else {
-            // The page is not used and not part of the free list
+            // The page is not mapped and not part of the free list
             pr_log(
                     "%-5d | %-12s | %-15s | 0x%013x | %-20s\n",
-                    i, "UNUSED", "", (uint32_t) info->paddr, decode_info_mode(info->info_mode)
+                    i, "UNUSED", "", (uint32_t) frame_paddr(i), decode_info_mode(frame_flags[i])
             );
         }
     }
+    pr_log("%u of %u frames free\n", free_page_count, frame_count);
     /* clang-format on*/
 }
 
@@ -722,7 +1450,7 @@ void print_fifo_queue()
     do {
         // Convert page index back to physical address for clarity, if needed
         uint32_t paddr_index = fifo_queue.queue[current];
-        uintptr_t *current_paddr = page_frame_info[paddr_index].paddr;
+        uintptr_t *current_paddr = frame_paddr(paddr_index);
         const char *position = "";
         if (current == fifo_queue.next_out) {
             position = "next_out";
@@ -736,38 +1464,71 @@ void print_fifo_queue()
         if (current == fifo_queue.next_in) {
             break; // If current has reached rear, break the loop
         }
-        current = (current + 1) % PAGEABLE_PAGES; // Cycle through the queue
+        current = (current + 1) % frame_count; // Cycle through the queue
     } while (current != fifo_queue.next_out);
 
     pr_log("----------------------------------------\n\n");
 }
 
-uint32_t* user_kernel_ptable;
+/*
+ * The kernel and the paging area are identity mapped up to wherever the
+ * paging area ends. The first 4MB go through a page table, as processes
+ * reach the video memory in them and the kernel stack area, reserved at
+ * the start of the paging area, has its guard pages there. Stacks do not
+ * come out of the frames allocate_page() hands out, so keeping them below
+ * 4MB takes nothing from it. With large pages the rest is mapped with 4MB
+ * pages, otherwise with one page table per 4MB. The identity map is global
+ * then, except for the video memory whose mode differs between processes
+ * and the kernel.
+ */
+#define KERNEL_PTABLES_MAX (PAGING_AREA_MAX_PADDR / PTABLE_SPAN)
 
-static void user_setup_kernel_vmem(uint32_t *pdir, int first_time)
+static bool large_pages; /* PSE and PGE are on, set at boot */
+
+static uint32_t kernel_map_end(void)
 {
-    uint32_t user_mode = PE_P | PE_RW | PE_US; // Access mode for user pages.
-    uint32_t kernel_mode = PE_P | PE_RW; // Access mode for kernel pages.
+    return paging_area_end > KERNEL_SIZE ? paging_area_end : KERNEL_SIZE;
+}
 
-    // Identity map the entire kernel region.
-    for (uint32_t paddr = 0; paddr < KERNEL_SIZE; paddr += PAGE_SIZE) {
-        if (first_time) table_map_page(user_kernel_ptable, paddr, paddr, kernel_mode);
-        dir_ins_table(pdir, paddr, user_kernel_ptable, kernel_mode);
-    }
+static uint32_t kernel_ptable_count(void)
+{
+    if (large_pages) return 1;
+    return (kernel_map_end() + PTABLE_SPAN - 1) / PTABLE_SPAN;
+}
 
-    // Extend the identity mapping to the entire physical memory range managed by the kernel.
-    for (uint32_t paddr = PAGING_AREA_MIN_PADDR; paddr < PAGING_AREA_MAX_PADDR; paddr += PAGE_SIZE) {
-        if (first_time) table_map_page(user_kernel_ptable, paddr, paddr, kernel_mode);
-        dir_ins_table(pdir, paddr, user_kernel_ptable, kernel_mode);
-    }
+uint32_t *user_kernel_ptables[KERNEL_PTABLES_MAX];
+
+/*
+ * Kernel part of every process page directory, built at boot and copied
+ * into new directories. It points to user_kernel_ptables, which processes
+ * share or get copies of, see PROCESSES_SHARE_KERNEL_PAGE_TABLE.
+ */
+static uint32_t user_pdir_template[KERNEL_PTABLES_MAX];
 
-    dir_ins_table(pdir, 0, user_kernel_ptable, kernel_mode);
+/*
+ * Identity maps the kernel and the paging area into 'pdir' with the page
+ * tables 'ptables', filling them in. The video memory gets 'vga_mode'.
+ */
+static void kernel_identity_map(uint32_t *pdir, uint32_t **ptables, uint32_t vga_mode)
+{
+    uint32_t kernel_mode = PE_P | PE_RW; // Access mode for kernel pages.
+    uint32_t global      = large_pages ? PE_G : 0;
+    uint32_t table_end   = MIN(kernel_map_end(), kernel_ptable_count() * PTABLE_SPAN);
 
+    for (uint32_t paddr = 0; paddr < table_end; paddr += PAGE_SIZE) {
+        if (kstack_guard(paddr)) continue;
+        table_map_page(ptables[paddr / PTABLE_SPAN], paddr, paddr, kernel_mode | global);
+    }
     // Map the video memory from 0xB8000 to 0xB8FFF.
-    int mode = user_mode;
-    mode |= PE_PCD; 
-    if (first_time) table_map_page(user_kernel_ptable, (uint32_t)VGA_TEXT_PADDR, (uint32_t)VGA_TEXT_PADDR, mode);
-    dir_ins_table(pdir, VGA_TEXT_PADDR, user_kernel_ptable, mode);
+    table_map_page(ptables[0], (uint32_t)VGA_TEXT_PADDR, (uint32_t)VGA_TEXT_PADDR, vga_mode);
+
+    for (uint32_t i = 0; i < kernel_ptable_count(); i++) {
+        dir_ins_table(pdir, i * PTABLE_SPAN, ptables[i], kernel_mode);
+    }
+    for (uint32_t paddr = table_end; paddr < kernel_map_end(); paddr += PTABLE_SPAN) {
+        pdir[get_directory_index(paddr)] = paddr | kernel_mode | PE_PS | PE_G;
+    }
+    dir_ins_table(pdir, VGA_TEXT_PADDR, ptables[0], vga_mode);
 }
 
 
@@ -775,162 +1536,204 @@ static void user_setup_kernel_vmem(uint32_t *pdir, int first_time)
 
 /* === Kernel and process setup === */
 
-static void setup_kernel_vmem_common(pcb_t *pcb, uint32_t *pdir, int is_user)
+/* Pinned kernel page tables of 'pcb', identity mapped with 'vga_mode' */
+static void setup_kernel_ptables(pcb_t *pcb, uint32_t **ptables, uint32_t *pdir, uint32_t vga_mode)
 {
-    uint32_t user_mode = PE_P | PE_RW | PE_US; // Access mode for user pages.
-    uint32_t kernel_mode = PE_P | PE_RW; // Access mode for kernel pages.
-
-    uint32_t *kernel_ptable = allocate_page();
-
-
-    // Conditionally apply the PE_INFO_PINNED flag depending on the pid of the process
-    uint32_t kernel_page_info_flags = PE_INFO_PINNED;
-    insert_page_frame_info(kernel_ptable, kernel_ptable, pcb, kernel_page_info_flags);
-
-    inc_pinned_pages(1); 
-
-    // Identity map the entire kernel region.
-    for (uint32_t paddr = 0; paddr < KERNEL_SIZE; paddr += PAGE_SIZE) {
-        table_map_page(kernel_ptable, paddr, paddr, kernel_mode);
-        dir_ins_table(pdir, paddr, kernel_ptable, kernel_mode);
+    for (uint32_t i = 0; i < kernel_ptable_count(); i++) {
+        ptables[i] = allocate_page();
+        insert_page_frame_info(ptables[i], ptables[i], pcb, PE_INFO_PINNED | PE_INFO_KERNEL_DUMMY);
+        inc_pinned_pages(1);
     }
+    kernel_identity_map(pdir, ptables, vga_mode | PE_PCD); // dont cache video memory
+}
 
-    // Extend the identity mapping to the entire physical memory range managed by the kernel.
-    for (uint32_t paddr = PAGING_AREA_MIN_PADDR; paddr < PAGING_AREA_MAX_PADDR; paddr += PAGE_SIZE) {
-        table_map_page(kernel_ptable, paddr, paddr, kernel_mode);
-        dir_ins_table(pdir, paddr, kernel_ptable, kernel_mode);
+/* Runs once at boot, before there is anyone to race with */
+static void setup_kernel_vmem(void)
+{
+    uint32_t features = cpuid_features_edx();
+    if (KERNEL_LARGE_PAGES && (features & CPUID_EDX_PSE) && (features & CPUID_EDX_PGE)) {
+        // paging is still off, the new modes take effect when it goes on
+        cr4_set(CR4_PSE | CR4_PGE);
+        large_pages = true;
     }
+    pr_info("identity map uses %s\n", large_pages ? "global 4MB pages" : "4KB pages");
 
-    dir_ins_table(pdir, 0, kernel_ptable, kernel_mode);
+    uint32_t *kernel_ptables[KERNEL_PTABLES_MAX];
 
-    // Map the video memory from 0xB8000 to 0xB8FFF.
-    int mode = (is_user ? user_mode : kernel_mode);
-    mode |= PE_PCD; // dont cache video memory
-    pr_log("user mode ?? %d\n", mode & PE_US);
-    table_map_page(kernel_ptable, (uint32_t)VGA_TEXT_PADDR, (uint32_t)VGA_TEXT_PADDR, mode);
-    dir_ins_table(pdir, VGA_TEXT_PADDR, kernel_ptable, mode);
+    dummy_kernel_pcb->is_thread = 1;
+    kernel_pdir = allocate_kernel_page();
+    setup_kernel_ptables(dummy_kernel_pcb, kernel_ptables, kernel_pdir, PE_P | PE_RW);
+    // processes write to the video memory themselves
+    setup_kernel_ptables(dummy_kernel_pcb, user_kernel_ptables, user_pdir_template,
+                         PE_P | PE_RW | PE_US);
+
+    // user mappings of the zero page are not in its reverse map, it is
+    // never evicted or written to
+    shared_zero_page = allocate_kernel_page();
 }
 
-static void setup_kernel_vmem(void)
+/*
+ * Allocates the pinned page directory of process 'p', with the kernel
+ * mapped into it from user_pdir_template. Can evict.
+ */
+static uint32_t *process_pdir_alloc(pcb_t *p)
 {
-    lock_acquire(&page_map_lock);
-    dummy_kernel_pcb->is_thread = 1;
-    uint32_t info_mode          = PE_INFO_PINNED | PE_INFO_KERNEL_DUMMY;
-    kernel_pdir = allocate_page();
-    insert_page_frame_info(
-            kernel_pdir, kernel_pdir, dummy_kernel_pcb, info_mode
-    );
+    // frames of exited processes' directories and tables come back zeroed
+    uint32_t *proc_pdir = allocate_page();
+    insert_page_frame_info(proc_pdir, proc_pdir, p, PE_INFO_USER_MODE | PE_INFO_PINNED); // Conditionally pin the page directory
     inc_pinned_pages(1);
-    setup_kernel_vmem_common(dummy_kernel_pcb, kernel_pdir, 0);
 
-    if (PROCESSES_SHARE_KERNEL_PAGE_TABLE) {
-        user_kernel_ptable = allocate_page();
-        uint32_t kernel_page_info_flags = PE_INFO_PINNED | PE_INFO_KERNEL_DUMMY;
-        insert_page_frame_info(user_kernel_ptable, user_kernel_ptable, dummy_kernel_pcb, kernel_page_info_flags);
-        inc_pinned_pages(1); 
+    if (first_process) {
+        nointerrupt_enter();
+        first_process_pid = p -> pid;
+        first_process = 0;
+        nointerrupt_leave();
     }
 
-    lock_release(&page_map_lock);
+    memcpy(proc_pdir, user_pdir_template, sizeof(user_pdir_template));
+    if (PROCESSES_SHARE_KERNEL_PAGE_TABLE) return proc_pdir;
+
+    for (uint32_t i = 0; i < kernel_ptable_count(); i++) {
+        uint32_t *table = allocate_page();
+        insert_page_frame_info(table, table, p, PE_INFO_PINNED);
+        inc_pinned_pages(1);
+        memcpy(table, user_kernel_ptables[i], PAGE_SIZE);
+        dir_ins_table(proc_pdir, i * PTABLE_SPAN, table, user_pdir_template[i]);
+    }
+    return proc_pdir;
 }
 
 void setup_process_vmem(pcb_t *p)
 {
-    lock_acquire(&page_map_lock);
+    // nobody else knows about p yet, so evicting while holding its lock
+    // can't deadlock
+    lock_acquire(&p->vmem_lock);
     pr_log("setup_process_vmem: setting up new process memory with pid: %u\n", p->pid);
 
     if (p->is_thread) {
         p->page_directory = kernel_pdir;
         pr_debug("setup_process_vmem: Done. Set up a new kernel thread with pid %u\n", p->pid);
-        lock_release(&page_map_lock);
+        lock_release(&p->vmem_lock);
         return;
     }
 
-    uint32_t base_page_info_flags = PE_INFO_USER_MODE | PE_INFO_PINNED;
-    uint32_t *proc_pdir = allocate_page();
-    insert_page_frame_info(proc_pdir, proc_pdir, p, base_page_info_flags); // Conditionally pin the page directory
-    uint32_t user_mode = PE_RW | PE_US;
+    uint64_t start = read_cpu_ticks();
 
-    if (first_process) {
-        nointerrupt_enter();
-        first_process_pid = p -> pid;
-        first_process = 0;
-        nointerrupt_leave();
-        // Ensure the kernel's virtual address space is mapped into the process's space
-        if (PROCESSES_SHARE_KERNEL_PAGE_TABLE) user_setup_kernel_vmem(proc_pdir, 1);
-    } else {
-        if (PROCESSES_SHARE_KERNEL_PAGE_TABLE) user_setup_kernel_vmem(proc_pdir, 0);
-    }
-    if (!PROCESSES_SHARE_KERNEL_PAGE_TABLE) setup_kernel_vmem_common(p, proc_pdir, 1);
+    // Nothing is mapped up front. The image is the extent of swap_size
+    // sectors at swap_loc, followed by bss up to mem_size, and its pages
+    // and page tables are filled in from that record on demand, see
+    // load_page_from_disk(). Stack pages are zero-filled on demand.
+    p->page_directory = process_pdir_alloc(p);
 
+    pr_debug("setup_process_vmem: done setup for process pid %u in %u us\n", p->pid,
+             (uint32_t) ((read_cpu_ticks() - start) / cpu_mhz));
+    lock_release(&p->vmem_lock);
+}
 
-    uint32_t *proc_ptable = allocate_page();
-    dir_ins_table(proc_pdir, PROCESS_VADDR, proc_ptable, user_mode | PE_P);
-    insert_page_frame_info(proc_ptable, proc_ptable, p, base_page_info_flags); // pin the page table
-    inc_pinned_pages(2); 
+/*
+ * Gives 'child' a copy of the address space of 'parent', the process
+ * running. Present pages are shared with PE_COW set in both, and copied
+ * by whichever process writes to them first. Entries for pages in swap or
+ * in the image are copied as they are.
+ */
+void fork_process_vmem(pcb_t *parent, pcb_t *child)
+{
+    uint32_t *pdir = parent->page_directory, *child_pdir, npresent = 0;
+    uint32_t  first = get_directory_index(PROCESS_VADDR);
+    rmap_t    spare = RMAP_NONE;
+
+    // Only the parent adds page tables to its directory, so they don't
+    // change until fork() returns. Everything that can evict is done here,
+    // before taking the parent's lock, including reading back the tables
+    // evicted while it was suspended.
+    for (uint32_t i = first; i < PAGE_N_ENTRIES; i++) {
+        if (pdir[i] & (PE_SWAPPED | PE_BUSY)) ptable_fault_in(parent, i << PAGE_DIRECTORY_BITS);
+    }
+    child_pdir            = process_pdir_alloc(child);
+    child->page_directory = child_pdir;
+    for (uint32_t i = first; i < PAGE_N_ENTRIES; i++) {
+        if (!(pdir[i] & PE_P)) continue;
+
+        uint32_t *table       = (uint32_t *) (pdir[i] & PE_BASE_ADDR_MASK);
+        uint32_t *child_table = allocate_page();
+        insert_page_frame_info(child_table, child_table, child, PE_INFO_USER_MODE | PE_INFO_PINNED);
+        inc_pinned_pages(1);
+        dir_ins_table(child_pdir, i << PAGE_DIRECTORY_BITS, child_table, pdir[i]);
 
-    uint32_t paddr, vaddr, offset;
-    uint32_t upper_lim = ((p->swap_size) * SECTOR_SIZE);
-    pr_debug("setup vmem: upper_lim = %u bytes = %u pages \n", upper_lim, upper_lim / PAGE_SIZE);
-    for (offset = 0; offset < upper_lim; offset += PAGE_SIZE) {
-        paddr = p->swap_loc * SECTOR_SIZE + offset;
-        vaddr = PROCESS_VADDR + offset;
-        nointerrupt_enter();
-        pr_debug("setup vmem: mapped vaddr 0x%08x to to user space for process pid %u\n", vaddr, p->pid);
-        nointerrupt_leave();
-        table_map_page(proc_ptable, vaddr, paddr, user_mode);
-        //dir_ins_table(proc_pdir, vaddr, proc_ptable, user_mode | PE_P);
-    }
-
-    // Allocate pages for the stack area assuming a fixed size stack area for each process
-    uint32_t *stack_page, stack_vaddr;
-    uint32_t stack_lim  = PROCESS_STACK_VADDR - USER_STACK_SIZE;
-    uint32_t stack_base = PROCESS_STACK_VADDR;
-    dir_ins_table(proc_pdir, stack_base, proc_ptable, user_mode | PE_P);
-
-    //uint32_t *stack_page_table = allocate_page();
-    //insert_page_frame_info(stack_page_table, stack_page_table, p, base_page_info_flags | PE_INFO_STACK);
-    //inc_pinned_pages(1);
-    for (stack_vaddr = stack_base; stack_vaddr > stack_lim; stack_vaddr -= PAGE_SIZE) {
-        stack_page = allocate_page();
-        insert_page_frame_info(
-            stack_page, (uintptr_t *) stack_vaddr, p,
-            base_page_info_flags | PE_INFO_STACK  // Apply the pinning flags consistently for stack pages
-        );
-        inc_pinned_pages(1);     // Allocate pages for the stack area assuming a fixed size stack area for each process
+        for (uint32_t index = 0; index < PAGE_N_ENTRIES; index++) {
+            if (table[index] & PE_P) npresent++;
+        }
+    }
 
-        pr_debug(
-            "allocated a stack frame with vaddr=%x at paddr %x, proceeding to map \n",
-            (uint32_t) stack_vaddr, (uint32_t) stack_page
-        );
-        table_map_page(proc_ptable, stack_vaddr, (uint32_t) stack_page, user_mode | PE_P);
-        //dir_ins_table(proc_pdir, stack_vaddr, proc_ptable, user_mode | PE_P);
+    // one mapping for each page the child shares, pages can only have
+    // been evicted since they were counted
+    for (uint32_t n = 0; n < npresent; n++) {
+        rmap_t r            = rmap_get();
+        rmap_entry(r)->next = spare;
+        spare               = r;
+    }
 
-        //table_map_page(stack_page_table, stack_vaddr, (uint32_t) stack_page, user_mode | PE_P);
-        //dir_ins_table(proc_pdir, stack_vaddr, stack_page_table, user_mode | PE_P);
-        
-    } 
+    lock_acquire(&parent->vmem_lock);
+    for (uint32_t i = first; i < PAGE_N_ENTRIES; i++) {
+        if (!(pdir[i] & PE_P)) continue;
 
-    // table_map_page(proc_ptable, stack_vaddr, (uint32_t) stack_page, user_mode | PE_P);
-    // dir_ins_table(proc_pdir, stack_vaddr, proc_ptable, user_mode | PE_P);
-    // table_map_page(stack_page_table, stack_vaddr, (uint32_t) stack_page, user_mode | PE_P);
-    // dir_ins_table(proc_pdir, stack_vaddr, stack_page_table, user_mode | PE_P);
+        uint32_t *table       = (uint32_t *) (pdir[i] & PE_BASE_ADDR_MASK);
+        uint32_t *child_table = (uint32_t *) (child_pdir[i] & PE_BASE_ADDR_MASK);
+        for (uint32_t index = 0; index < PAGE_N_ENTRIES; index++) {
+            // a page on its way to or from swap is copied once it settles
+            nointerrupt_enter();
+            while (table[index] & PE_BUSY) {
+                nointerrupt_leave();
+                condition_wait(&parent->vmem_lock, &parent->vmem_busy);
+                nointerrupt_enter();
+            }
 
-    p->page_directory = proc_pdir;
-    pr_debug("setup_process_vmem: done setup for process pid %u\n", p->pid);
-    lock_release(&page_map_lock);
+            uint32_t entry = table[index];
+            if (!(entry & PE_P)) {
+                if (entry & PE_SWAPPED) swap_dup(entry >> PE_BASE_ADDR_BITS);
+                child_table[index] = entry;
+            } else if ((entry & PE_BASE_ADDR_MASK) == (uint32_t) shared_zero_page) {
+                child_table[index] = entry & ~PE_A;
+            } else {
+                frame_t frame = frame_index((uintptr_t *) (entry & PE_BASE_ADDR_MASK));
+                rmap_t  r     = spare;
+                assertk(r != RMAP_NONE);
+                spare = rmap_entry(r)->next;
+                rmap_link(frame, r, child, (i << PAGE_DIRECTORY_BITS) | (index << PAGE_TABLE_BITS), 0);
+
+                // both keep PE_D, whoever ends up with the frame must
+                // still write it to swap
+                table[index]       = (entry & ~PE_RW) | PE_COW;
+                child_table[index] = table[index] & ~PE_A;
+            }
+            nointerrupt_leave();
+        }
+    }
+    // the parent's mappings just became read-only
+    flush_tlb();
+    lock_release(&parent->vmem_lock);
+
+    while (spare != RMAP_NONE) {
+        rmap_t r = spare;
+        spare    = rmap_entry(r)->next;
+        rmap_put(r);
+    }
+    pr_debug("fork_process_vmem: pid %u forked into pid %u, %u pages shared\n",
+             parent->pid, child->pid, npresent);
 }
 
 /*
  * init_memory()
  *
- * called once by _start() in kernel.c
+ * called once by kernel_main() in kernel.c, with the memory map collected
+ * by the bootblock
  * You need to set up the virtual memory map for the kernel here.
  */
-void init_memory(void)
+void init_memory(const struct memory_map *map)
 {
-    initialize_page_frame_infos();
-    fifo_init();
     next_free_mem = PAGING_AREA_MIN_PADDR;
+    kstack_area_init(map);
+    frame_table_init(map);
     setup_kernel_vmem();
 }
 
@@ -982,9 +1785,7 @@ uint32_t *select_page_for_eviction_v1()
         abortk();
     }
 
-    spinlock_acquire(&page_frame_info_lock);
-    uint32_t *paddr = page_frame_info[index].paddr;
-    spinlock_release(&page_frame_info_lock);
+    uint32_t *paddr = frame_paddr(index);
 
     if (paddr == NULL) {
         pr_error(
@@ -1007,65 +1808,266 @@ static uint32_t random_index_val = 45;
 int random_index_generator(void)
 {
     random_index_val = random_index_val * 1103515245 + 12345 + (read_cpu_ticks() % 2397);
-    return (random_index_val / 65536) % PAGEABLE_PAGES;
+    return (random_index_val / 65536) % frame_count;
 }
 
 
 uint32_t *evict_random_page()
 {
     uint32_t index = random_index_generator();
-    while (page_frame_info[index].info_mode & PE_INFO_PINNED) {
+    while (frame_rmap[index] == RMAP_NONE
+           || frame_flags[index] & (PE_INFO_PINNED | PE_INFO_IN_TRANSIT)) {
         index = random_index_generator();
     }
-    return page_frame_info[index].paddr;
+    return frame_paddr(index);
 }
 
 
+/* === Enhanced clock (second chance) eviction === */
 
-uint32_t *select_page_for_eviction()
+static uint32_t clock_hand = 0;
+
+/*
+ * A frame is a candidate for the clock if it is in use by a user process
+ * and is neither pinned, owned by the kernel nor being read from disk. With
+ * 'owner' set, it must also be mapped by that process alone.
+ */
+static bool clock_is_candidate(frame_t frame, pcb_t *owner)
 {
-    uint32_t* evicted_page;
-    if (EVICTION_STRATEGY == EVICTION_STRATEGY_RANDOM) {
-        evicted_page = evict_random_page();
-    } else if (EVICTION_STRATEGY == EVICTION_STRATEGY_FIFO) {
-        evicted_page = select_page_for_eviction_v1();
-        //return select_page_for_eviction_v2();
-    }
-    if (page_frame_info[calculate_info_index(evicted_page)].owner) {
-        invalidate_page(page_frame_info[calculate_info_index(evicted_page)].vaddr);
+    if (frame_rmap[frame] == RMAP_NONE
+        || (frame_flags[frame] & (PE_INFO_PINNED | PE_INFO_KERNEL_DUMMY | PE_INFO_IN_TRANSIT))) {
+        return false;
     }
-    return evicted_page;
+    struct rmap *main = rmap_entry(frame_rmap[frame]);
+    return !owner || (main->owner == owner && main->next == RMAP_NONE);
 }
 
+/*
+ * Collects the accessed and dirty bits from the page table entries of every
+ * process sharing the frame at 'index'. If 'clear_accessed' is set, the
+ * accessed bits are cleared on the way, giving the frame its second chance.
+ *
+ * Returns the union of PE_A and PE_D over all mappings.
+ */
+static uint32_t clock_collect_bits(uint32_t index, int clear_accessed)
+{
+    uint32_t bits = 0;
+
+    for (rmap_t r = frame_rmap[index]; r != RMAP_NONE; r = rmap_entry(r)->next) {
+        struct rmap *map   = rmap_entry(r);
+        uint32_t     vaddr = map->vaddr;
+        uint32_t    *entry =
+                get_page_table_entry(vaddr, map->owner->page_directory);
+        if (!entry || !(*entry & PE_P)) continue;
+
+        bits |= *entry & (PE_A | PE_D);
+        if (clear_accessed && (*entry & PE_A)) {
+            *entry &= ~PE_A;
+            invalidate_page((uintptr_t *) vaddr);
+        }
+    }
 
+    // a prefetched page that has been touched was worth reading, remember
+    // that before the accessed bit is gone
+    if (bits & PE_A) frame_flags[index] &= ~PE_INFO_PREFETCHED;
+    return bits;
+}
 
-
-// Checks if the given page is dirty by looking up its page table entry
-bool is_page_dirty(uint32_t vaddr, uint32_t *page_directory)
+/*
+ * Enhanced clock algorithm (Tanenbaum MOS, "the second chance algorithm"
+ * with the modified bit as a secondary key).
+ *
+ * Frames fall into four classes by their (accessed, dirty) bits. The hand
+ * sweeps the frame table looking for the best class available:
+ *
+ *   round 1: look for (0, 0) without touching any bits
+ *   round 2: look for (0, 1), clearing accessed bits as we pass
+ *
+ * If both rounds fail, every accessed bit has been cleared, so repeating
+ * them is guaranteed to find a victim as long as any frame is evictable.
+ *
+ * The global clock sweeps all frames with clock_hand. Replacement local to
+ * a process only looks at its own frames, with a hand of its own.
+ */
+static uint32_t *clock_select(uint32_t *hand, pcb_t *owner)
 {
-    uint32_t dir_index = get_directory_index(vaddr);
-    uint32_t dir_entry = page_directory[dir_index];
-    if (!(dir_entry & PE_P)) {
-        // Page directory entry is not present.
-        return false;
+    nointerrupt_enter();
+    for (int attempt = 0; attempt < 2; attempt++) {
+        for (int round = 0; round < 2; round++) {
+            int clear_accessed = (round == 1);
+            uint32_t want      = (round == 1) ? PE_D : 0;
+
+            for (uint32_t scanned = 0; scanned < frame_count; scanned++) {
+                uint32_t index = *hand;
+                *hand          = (*hand + 1) % frame_count;
+
+                if (!clock_is_candidate(index, owner)) continue;
+
+                uint32_t bits = clock_collect_bits(index, clear_accessed);
+                if (bits == want) {
+                    if (MEMDEBUG) {
+                        pr_log("clock: evicting frame %u (attempt %d, round %d, bits %x)\n",
+                               index, attempt, round, bits);
+                    }
+                    nointerrupt_leave();
+                    return frame_paddr(index);
+                }
+            }
+        }
     }
-    uint32_t *page_table  = (uint32_t *) (dir_entry & PE_BASE_ADDR_MASK);
-    uint32_t  table_index = get_table_index(vaddr);
-    uint32_t  page_entry  = page_table[table_index];
-    return page_entry & PE_D;
+    nointerrupt_leave();
+
+    // nothing evictable, the caller decides whether that is an error
+    return NULL;
 }
 
-void unmap_physical_page(uint32_t *process_directory, uint32_t vaddr)
+uint32_t *select_page_for_eviction_clock()
 {
-    page_set_mode(process_directory, vaddr, 0);
+    return clock_select(&clock_hand, NULL);
 }
+
+
+/* === WSClock eviction === */
+
+static uint32_t wsclock_hand = 0;
+
+/* Dirty pages that have left their working set, to be written to swap */
+static frame_t  wsclock_writeback[WSCLOCK_WRITEBACK_PAGES];
+static uint32_t wsclock_writeback_count;
+
 /*
- * Given a virtual address and a pointer to the page directory, it
- * returns a pointer to the relevant page table.
+ * Virtual time of 'p' in millisecs: the CPU time it has used, including
+ * the time slice it is running in now.
  */
-uint32_t *get_page_table(uint32_t vaddr, uint32_t *page_directory)
+static uint32_t virtual_msecs(pcb_t *p)
 {
-    uint32_t dir_index = get_directory_index(vaddr);
+    uint64_t ticks = p->virtual_time;
+
+    if (p == current_running) ticks += read_cpu_ticks() - p->dispatch_time;
+    return ticks / ((uint64_t) cpu_mhz * 1000);
+}
+
+/* Queue 'frame' for page_clean(). Called with interrupts disabled. */
+static void wsclock_queue_writeback(frame_t frame)
+{
+    for (uint32_t i = 0; i < wsclock_writeback_count; i++) {
+        if (wsclock_writeback[i] == frame) return;
+    }
+    if (wsclock_writeback_count < WSCLOCK_WRITEBACK_PAGES) {
+        wsclock_writeback[wsclock_writeback_count++] = frame;
+    }
+}
+
+/*
+ * WSClock (Carr and Hennessy, also in Tanenbaum MOS).
+ *
+ * The hand sweeps the frame table like the clock, but instead of the
+ * accessed bit alone it goes by the working set of the owner of each
+ * frame: the pages it has used in the last WSCLOCK_TAU millisecs of its
+ * own CPU time. A frame found accessed has its last-use time set to the
+ * owner's virtual time. One not used for longer than that is out of the
+ * working set, and is taken if clean. If dirty, it is queued to be written
+ * to swap by the reclaim thread and the hand moves on, so that it is clean
+ * by the next time round.
+ *
+ * If a whole sweep finds no clean page outside its working set, the page
+ * unused for longest is taken, clean pages before dirty ones.
+ */
+uint32_t *select_page_for_eviction_wsclock()
+{
+    frame_t  best       = FRAME_NONE;
+    bool     best_dirty = true;
+    uint32_t best_age   = 0;
+
+    nointerrupt_enter();
+    for (uint32_t scanned = 0; scanned < frame_count; scanned++) {
+        uint32_t index = wsclock_hand;
+        wsclock_hand   = (wsclock_hand + 1) % frame_count;
+
+        if (!clock_is_candidate(index, NULL)) continue;
+
+        uint32_t now  = virtual_msecs(rmap_entry(frame_rmap[index])->owner);
+        uint32_t bits = clock_collect_bits(index, 1);
+        if (bits & PE_A) frame_last_use[index] = now;
+
+        uint32_t age   = now - frame_last_use[index];
+        bool     dirty = bits & PE_D;
+        if (age > WSCLOCK_TAU) {
+            if (!dirty) {
+                if (MEMDEBUG) pr_log("wsclock: evicting frame %u (age %u)\n", index, age);
+                nointerrupt_leave();
+                return frame_paddr(index);
+            }
+            wsclock_queue_writeback(index);
+        }
+
+        if (best == FRAME_NONE || dirty < best_dirty
+            || (dirty == best_dirty && age > best_age)) {
+            best       = index;
+            best_dirty = dirty;
+            best_age   = age;
+        }
+    }
+    nointerrupt_leave();
+
+    if (MEMDEBUG && best != FRAME_NONE) {
+        pr_log("wsclock: no page outside its working set, evicting frame %u\n", best);
+    }
+    return best == FRAME_NONE ? NULL : frame_paddr(best);
+}
+
+
+
+uint32_t *select_page_for_eviction()
+{
+    uint32_t* evicted_page = NULL;
+    if (EVICTION_STRATEGY == EVICTION_STRATEGY_RANDOM) {
+        evicted_page = evict_random_page();
+    } else if (EVICTION_STRATEGY == EVICTION_STRATEGY_FIFO) {
+        evicted_page = select_page_for_eviction_v1();
+        //return select_page_for_eviction_v2();
+    } else if (EVICTION_STRATEGY == EVICTION_STRATEGY_CLOCK) {
+        evicted_page = select_page_for_eviction_clock();
+    } else if (EVICTION_STRATEGY == EVICTION_STRATEGY_WSCLOCK) {
+        evicted_page = select_page_for_eviction_wsclock();
+    }
+    if (!evicted_page) return NULL;
+    rmap_t main = frame_rmap[frame_index(evicted_page)];
+    if (main != RMAP_NONE) {
+        invalidate_page((uint32_t *) rmap_entry(main)->vaddr);
+    }
+    return evicted_page;
+}
+
+
+
+
+// Checks if the given page is dirty by looking up its page table entry
+bool is_page_dirty(uint32_t vaddr, uint32_t *page_directory)
+{
+    uint32_t dir_index = get_directory_index(vaddr);
+    uint32_t dir_entry = page_directory[dir_index];
+    if (!(dir_entry & PE_P)) {
+        // Page directory entry is not present.
+        return false;
+    }
+    uint32_t *page_table  = (uint32_t *) (dir_entry & PE_BASE_ADDR_MASK);
+    uint32_t  table_index = get_table_index(vaddr);
+    uint32_t  page_entry  = page_table[table_index];
+    return page_entry & PE_D;
+}
+
+void unmap_physical_page(uint32_t *process_directory, uint32_t vaddr)
+{
+    page_set_mode(process_directory, vaddr, 0);
+}
+/*
+ * Given a virtual address and a pointer to the page directory, it
+ * returns a pointer to the relevant page table.
+ */
+uint32_t *get_page_table(uint32_t vaddr, uint32_t *page_directory)
+{
+    uint32_t dir_index = get_directory_index(vaddr);
     uint32_t dir_entry = page_directory[dir_index];
     if (!(dir_entry & PE_P)) {
         pr_debug(
@@ -1079,74 +2081,35 @@ uint32_t *get_page_table(uint32_t vaddr, uint32_t *page_directory)
     return page_table;
 }
 
-char write_buffer[PAGE_SIZE];
-lock_t write_buffer_lock = LOCK_INIT;
-int write_page_back_to_disk(uint32_t vaddr, pcb_t *pcb, uint32_t* paddr)
+/*
+ * Given a virtual address and a pointer to the page directory, it
+ * returns a pointer to the page table entry mapping the address, or NULL
+ * if there is no page table covering it.
+ */
+uint32_t *get_page_table_entry(uint32_t vaddr, uint32_t *page_directory)
 {
+    uint32_t dir_entry = page_directory[get_directory_index(vaddr)];
+    if (!(dir_entry & PE_P) || (dir_entry & PE_PS)) return NULL;
 
-    /*
-     * pcb-> swap_loc is sector number on disk, pcb -> swap_size is number
-     * of sectors.
-     */
+    uint32_t *page_table = (uint32_t *) (dir_entry & PE_BASE_ADDR_MASK);
+    return &page_table[get_table_index(vaddr)];
+}
 
-    // Calculate the disk offset based on the physical address.
-    int      success     = -1;
-    uint32_t disk_offset = (vaddr - PROCESS_VADDR) / PAGE_SIZE;
-    disk_offset *= (PAGE_SIZE / SECTOR_SIZE);
-    uint32_t write_block_count = MIN(PAGE_SIZE / SECTOR_SIZE, pcb->swap_size - disk_offset);
-    uint32_t disk_loc = pcb->swap_loc + disk_offset;
+/*
+ * Write the page frame 'paddr', mapped at 'vaddr' in 'pcb', to swap slot
+ * 'slot'.
+ */
+int write_page_to_swap(uint32_t vaddr, pcb_t *pcb, uint32_t *paddr, int slot)
+{
+    int      success;
+    uint32_t disk_loc = swap_slot_sector(slot);
 
-    if (disk_offset > pcb->swap_size) {
-        nointerrupt_enter();
-        pr_error(
-                "too large virtual address for the swap image for pid "
-                "%u\n",
-                pcb->pid
-        );
-        nointerrupt_leave();
-        return success;
-    }
+    success = scsi_write(disk_loc, SECTORS_PER_PAGE, (char *) paddr);
 
-    uint32_t *frameref_table;
-    if (!(frameref_table = get_page_table(vaddr, pcb->page_directory))) {
-         // nothing to do, no page with this virtual address precent in pcb
-         // page dir
-         pr_error(
-                 "write_page_back_to_disk: no vaddr found in page "
-                 "directory\n"
-         );
-         return -1;
-    }
-    //uint32_t *frameref = (uint32_t *) (frameref_table[get_table_index(vaddr)] & PE_BASE_ADDR_MASK);
-    char *frameref = (char*) (frameref_table[get_table_index(vaddr)] & PE_BASE_ADDR_MASK);
-    //for (int i=0; i < PAGE_SIZE; i++) write_buffer[i] = frameref[i];
-    //lock_acquire(&write_buffer_lock);
-    //nointerrupt_enter();
-    //bcopy((char *) frameref, write_buffer, PAGE_SIZE);
-    //nointerrupt_leave();
-    //success = scsi_write(disk_loc, write_block_count, write_buffer);
-    //success = scsi_write(disk_loc, write_block_count, frameref);
-    //lock_release(&write_buffer_lock);
-
-    //success = scsi_write(disk_loc, write_block_count, (char *) frameref);
-
-    // for(int i=0; i < PAGE_SIZE; i++) write_buffer[i] = paddr[i];
-    // nointerrupt_enter();
-    // bcopy((char *) paddr, write_buffer, PAGE_SIZE);
-    // nointerrupt_leave();
-    // success = scsi_write(disk_loc, write_block_count, write_buffer);
-    
-    
-    lock_acquire(&write_buffer_lock);
-    success = scsi_write(disk_loc, write_block_count, (char *) paddr);
-    //if (pcb == current_running) invalidate_page((uintptr_t *)vaddr);
-    invalidate_page((uintptr_t *)vaddr);
-    lock_release(&write_buffer_lock);
-    
     /* clang-format off */
     if (MEMDEBUG) {
-        pr_log( "write_page_back_to_disk: Page at virtual address 0x%08x referencing frame %0x08x written back to disk at offset 0x%08x = %u for pid %u\n", 
-                                                                    vaddr, (uint32_t) frameref, disk_offset, disk_offset,  pcb->pid);
+        pr_log( "write_page_to_swap: Page at virtual address 0x%08x referencing frame 0x%08x written to swap slot %d (sector %u) for pid %u\n",
+                                                                    vaddr, (uint32_t) paddr, slot, disk_loc, pcb->pid);
     }
     /* clang-format on */
     return success;
@@ -1162,59 +2125,322 @@ int write_page_back_to_disk(uint32_t vaddr, pcb_t *pcb, uint32_t* paddr)
         /* clang-format on */ \
     }
 
-char read_buffer[PAGE_SIZE];
-lock_t read_buffer_lock = LOCK_INIT;
-
-int disk_loader(int disk_loc, int block_count, uint32_t *frameref) {
-
-    lock_acquire(&read_buffer_lock);
+/*
+ * Read 'block_count' sectors starting at 'disk_loc' straight into the
+ * 'nframes' physically contiguous frames starting at 'frame'. The USB
+ * controller transfers into the frames directly, they are identity mapped
+ * in the kernel. Only the tail not covered by the read is zero filled.
+ */
+int disk_loader(int disk_loc, int block_count, uint32_t *frame, int nframes)
+{
+    int read_size = block_count * SECTOR_SIZE;
 
-    // clear the read buffer
-    for (int i = 0; i < PAGE_SIZE; i++) read_buffer[i] = 0;
+    assertk(read_size <= nframes * PAGE_SIZE);
 
-    int success = scsi_read(disk_loc, block_count, (void *) read_buffer);
+    int success = scsi_read(disk_loc, block_count, (char *) frame);
     if (success >= 0) {
-        nointerrupt_enter();
-        bcopy(read_buffer, (char *) frameref, PAGE_SIZE);
-        nointerrupt_leave();
+        bzero((char *) frame + read_size, nframes * PAGE_SIZE - read_size);
     } else {
         pr_log("failed to read from disk\n");
     }
-    lock_release(&read_buffer_lock);
     return success;
 }
 
+/* Lowest page the user stack may grow down to, the guard page is below it */
+#define USER_STACK_LIMIT \
+    ((PROCESS_STACK_VADDR & PE_BASE_ADDR_MASK) - (USER_STACK_MAX_PAGES - 1) * PAGE_SIZE)
 
-int load_page_from_disk(uint32_t vaddr, pcb_t *pcb)
+/* Whether 'vaddr' is within the process image of 'pcb', bss included */
+static bool user_image_page(pcb_t *pcb, uint32_t vaddr)
 {
-    /*
-     * pcb-> swap_loc is sector number on disk, pcb -> swap_size is number
-     * of sectors.
-     */
+    return PROCESS_VADDR <= vaddr && vaddr < PROCESS_VADDR + pcb->mem_size * SECTOR_SIZE;
+}
 
-    uint32_t *fault_dir, *frameref_table, *frameref, disk_offset, block_count;
-    uint32_t info_mode, mode, disk_loc;
+/* Whether 'vaddr' is in the bss of 'pcb', past what the image holds */
+static bool user_bss_page(pcb_t *pcb, uint32_t vaddr)
+{
+    return user_image_page(pcb, vaddr)
+           && vaddr >= PROCESS_VADDR + pcb->swap_size * SECTOR_SIZE;
+}
 
-    fault_dir   = pcb->page_directory;
-    disk_offset = (vaddr - PROCESS_VADDR) / PAGE_SIZE;
-    disk_offset *= (PAGE_SIZE / SECTOR_SIZE);
-    //assertk(disk_offset < pcb->swap_size);
-    if (disk_offset > pcb->swap_size) {
-        pr_debug("allocating extra stack space? vaddr = 0x%08x \n", vaddr);
+/* Whether 'vaddr' is where the user stack may grow */
+static bool user_stack_page(uint32_t vaddr)
+{
+    return USER_STACK_LIMIT <= vaddr
+           && vaddr < (PROCESS_STACK_VADDR & PE_BASE_ADDR_MASK) + PAGE_SIZE;
+}
+
+/* Whether 'vaddr' is in the unmapped page below the stack limit */
+static bool user_stack_guard(uint32_t vaddr)
+{
+    return USER_STACK_LIMIT - PAGE_SIZE <= vaddr && vaddr < USER_STACK_LIMIT;
+}
+
+/*
+ * Number of pages to read for a fault on the image page at 'vaddr',
+ * including the faulting page itself.
+ *
+ * The following pages are read along with it as long as they are in the
+ * process image, not present, not in swap (so they are contiguous on
+ * disk), covered by the same page table, and there are free frames to hold
+ * them. Prefetching never evicts anything. The caller cuts the run short
+ * to the longest run of physically contiguous free frames it finds.
+ */
+static uint32_t fault_around_pages(pcb_t *pcb, uint32_t vaddr)
+{
+    uint32_t *table     = get_page_table(vaddr, pcb->page_directory);
+    uint32_t  image_end = PROCESS_VADDR + pcb->swap_size * SECTOR_SIZE;
+    uint32_t  n         = 1;
+
+    // the process is walking through its image, read further ahead
+    if (vaddr == pcb->fault_around_next) {
+        pcb->fault_around = MIN(pcb->fault_around * 2, FAULT_AROUND_MAX_PAGES);
+    }
+
+    while (table && n < pcb->fault_around && n < free_page_count) {
+        uint32_t next = vaddr + n * PAGE_SIZE;
+        if (next >= image_end || get_table_index(next) == 0) break;
+        if (table[get_table_index(next)] & (PE_P | PE_SWAPPED | PE_BUSY)) break;
+        // no need to read what another process has in the page cache
+        nointerrupt_enter();
+        frame_t cached = page_cache_lookup(pcb->swap_loc + (next - PROCESS_VADDR) / SECTOR_SIZE);
+        nointerrupt_leave();
+        if (cached != FRAME_NONE) break;
+        n++;
     }
 
-    // Compute the actual disk location by adding the swap location
-    disk_loc = pcb->swap_loc + disk_offset;
+    pcb->fault_around_next = vaddr + n * PAGE_SIZE;
+    return n;
+}
 
-    // Determine the number of sectors to read, ensuring not to exceed file boundaries
-    block_count = MIN(PAGE_SIZE / SECTOR_SIZE, pcb->swap_size - disk_offset);
+/* A page read by fault-around was evicted unused, read less ahead. */
+static void fault_around_shrink(pcb_t *pcb)
+{
+    if (pcb->fault_around > 1) pcb->fault_around /= 2;
+    if (MEMDEBUG) {
+        pr_log("fault-around: pid %u window shrunk to %u pages\n",
+               pcb->pid, pcb->fault_around);
+    }
+}
+
+
+/*
+ * Maps the standby frame 'frame' back in at 'vaddr' of 'pcb', whose page
+ * it holds, with the mapping 'r'. The page table entry tells where the
+ * page would otherwise have been read from, and the frame is handled as if
+ * it just had been. Called with the vmem_lock held and interrupts off.
+ */
+static void standby_page_map(frame_t frame, rmap_t r, pcb_t *pcb, uint32_t vaddr, uint32_t info_mode)
+{
+    uint32_t *entry = get_page_table_entry(vaddr, pcb->page_directory);
+    uint32_t  mode  = PE_P | PE_RW | PE_US;
+
+    standby_remove(frame);
+    if (user_stack_page(vaddr)) info_mode |= PE_INFO_STACK;
+    rmap_link(frame, r, pcb, vaddr, info_mode);
+    if (!(info_mode & PE_INFO_PINNED) && EVICTION_STRATEGY == EVICTION_STRATEGY_FIFO) {
+        fifo_enqueue_info(frame_paddr(frame));
+    }
 
+    if (*entry & PE_SWAPPED) {
+        // the entry's reference to the slot passes to the frame
+        frame_swap_slot[frame] = *entry >> PE_BASE_ADDR_BITS;
+    } else if (user_image_page(pcb, vaddr) && !user_bss_page(pcb, vaddr)) {
+        uint32_t sector = pcb->swap_loc + (vaddr - PROCESS_VADDR) / SECTOR_SIZE;
+        if (page_cache_insert(frame, sector)) mode = PE_P | PE_US | PE_COW;
+    }
+    table_map_page(get_page_table(vaddr, pcb->page_directory), vaddr,
+                   (uint32_t) frame_paddr(frame), mode);
     if (MEMDEBUG) {
+        pr_log("load_page_from_disk: pid %u takes back standby page 0x%08x at 0x%08x\n",
+               pcb->pid, (uint32_t) frame_paddr(frame), vaddr);
+    }
+}
+
+/*
+ * Marks or unmarks the 'npages' page table entries from 'vaddr' as
+ * PE_BUSY. The caller holds the vmem_lock of the address space.
+ */
+static void page_set_busy(uint32_t *table, uint32_t vaddr, uint32_t npages, int busy)
+{
+    for (uint32_t i = 0; i < npages; i++) {
+        uint32_t index = get_table_index(vaddr + i * PAGE_SIZE);
+        if (busy) table[index] |= PE_BUSY;
+        else table[index] &= ~PE_BUSY;
+    }
+}
+
+/* === Swappable page tables === */
+
+/*
+ * A user page table that maps none of its process' resident pages can be
+ * evicted. Its entries are then either empty, for pages that are read from
+ * the image or zero-filled as the pcb describes, or refer to swap slots. A
+ * table without slots is dropped, and an empty one takes its place on the
+ * next fault in its range. One with slots is written to a swap slot of its
+ * own, recorded in the directory entry with PE_SWAPPED as for a page, and
+ * read back by the next fault in its range. The directory entry is PE_BUSY
+ * while the table is being written.
+ *
+ * Tables are only evicted from suspended processes, which were stopped in
+ * user mode and so are nowhere in the fault path with a table in hand.
+ */
+
+/*
+ * Number of entries of 'table' referring to swap slots, or -1 if it maps
+ * a resident page or one in transit. The zero page doesn't count.
+ */
+static int ptable_swapped_entries(uint32_t *table)
+{
+    int n = 0;
+
+    for (uint32_t index = 0; index < PAGE_N_ENTRIES; index++) {
+        uint32_t entry = table[index];
+        if (entry & PE_BUSY) return -1;
+        if (entry & PE_P) {
+            if ((entry & PE_BASE_ADDR_MASK) != (uint32_t) shared_zero_page) return -1;
+        } else if (entry & PE_SWAPPED) {
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Evict page table 'i' of the suspended process 'p', if it can be */
+static bool ptable_evict(pcb_t *p, uint32_t i)
+{
+    uint32_t *pde = &p->page_directory[i];
+    uint32_t *table;
+    int       n, slot = SWAP_NO_SLOT;
+
+    lock_acquire(&p->vmem_lock);
+    nointerrupt_enter();
+    table = (uint32_t *) (*pde & PE_BASE_ADDR_MASK);
+    n     = (*pde & PE_P) && p->suspended ? ptable_swapped_entries(table) : -1;
+    if (n >= 0) {
+        // bss mapped to the zero page is mapped to it again on a fault
+        for (uint32_t index = 0; index < PAGE_N_ENTRIES; index++) {
+            if (table[index] & PE_P) table[index] = 0;
+        }
+        *pde = n ? (uint32_t) table | PE_BUSY : 0;
+    }
+    nointerrupt_leave();
+    lock_release(&p->vmem_lock);
+    if (n < 0) return false;
+
+    if (n > 0) {
+        slot         = swap_alloc();
+        bool written = slot != SWAP_NO_SLOT
+                       && (zswap_store(slot, table)
+                           || write_page_to_swap(i << PAGE_DIRECTORY_BITS, p, table, slot) >= 0);
+
+        lock_acquire(&p->vmem_lock);
+        if (written) {
+            *pde = ((uint32_t) slot << PE_BASE_ADDR_BITS) | PE_SWAPPED;
+        } else {
+            *pde = (uint32_t) table | PE_P | PE_RW | PE_US;
+            if (slot != SWAP_NO_SLOT) swap_free(slot);
+        }
+        condition_broadcast(&p->vmem_busy);
+        lock_release(&p->vmem_lock);
+        if (!written) return false;
+    }
+
+    page_clear_info(table);
+    nointerrupt_enter();
+    add_page_frame_to_free_list_info(table);
+    nointerrupt_leave();
+    inc_pinned_pages(-1);
+
+    if (MEMDEBUG) {
+        pr_log("ptable_evict: pid %u page table for 0x%08x %s\n", p->pid,
+               i << PAGE_DIRECTORY_BITS, n ? "written to swap" : "dropped");
+    }
+    return true;
+}
+
+void ptable_trim(pcb_t *p)
+{
+    uint32_t first = get_directory_index(PROCESS_VADDR), evicted = 0;
+
+    if (p->is_thread) return;
+
+    // stop if it is resumed, its tables are about to be used again
+    for (uint32_t i = first; i < PAGE_N_ENTRIES && p->suspended; i++) {
+        if (ptable_evict(p, i)) evicted++;
+    }
+    if (evicted) pr_debug("evicted %u page tables of pid %u\n", evicted, p->pid);
+}
+
+/*
+ * The page table covering 'vaddr' in 'pcb', adding an empty one or reading
+ * back the evicted one if there is none. Only called by the process itself,
+ * or on its behalf when it can't run, so nobody else adds the table in the
+ * meantime. Can evict.
+ */
+static uint32_t *ptable_fault_in(pcb_t *pcb, uint32_t vaddr)
+{
+    uint32_t *pde   = &pcb->page_directory[get_directory_index(vaddr)];
+    uint32_t *table = get_page_table(vaddr, pcb->page_directory);
+    int       slot;
+
+    if (table) return table;
+
+    // allocating can evict, so do it before taking the lock
+    table = allocate_page();
+    insert_page_frame_info(table, table, pcb, PE_INFO_USER_MODE | PE_INFO_PINNED);
+    inc_pinned_pages(1);
+
+    lock_acquire(&pcb->vmem_lock);
+    // the table is being written out, wait for it to get its slot
+    while (*pde & PE_BUSY) condition_wait(&pcb->vmem_lock, &pcb->vmem_busy);
+    if (*pde & PE_P) {
+        // the write failed and the old table stayed
+        lock_release(&pcb->vmem_lock);
+        page_clear_info(table);
         nointerrupt_enter();
-        load_page_pr_log(pcb->pid, (void *) vaddr, disk_offset, pcb->swap_size);
+        push_free_frame(frame_index(table), true);
         nointerrupt_leave();
+        inc_pinned_pages(-1);
+        return get_page_table(vaddr, pcb->page_directory);
+    }
+    slot = (*pde & PE_SWAPPED) ? (int) (*pde >> PE_BASE_ADDR_BITS) : SWAP_NO_SLOT;
+    lock_release(&pcb->vmem_lock);
+
+    if (slot != SWAP_NO_SLOT) {
+        bool loaded = zswap_load(slot, table)
+                      || disk_loader(swap_slot_sector(slot), SECTORS_PER_PAGE, table, 1) >= 0;
+        assertf(loaded, "failed to read page table of pid %u from swap slot %d\n",
+                pcb->pid, slot);
+        swap_free(slot);
+        pcb->major_fault_count++;
     }
 
+    lock_acquire(&pcb->vmem_lock);
+    dir_ins_table(pcb->page_directory, vaddr, table, PE_P | PE_RW | PE_US);
+    lock_release(&pcb->vmem_lock);
+    return table;
+}
+
+int load_page_from_disk(uint32_t vaddr, pcb_t *pcb)
+{
+    /*
+     * pcb-> swap_loc is sector number on disk, pcb -> swap_size is number
+     * of sectors. Pages past swap_size, up to mem_size, are bss.
+     */
+
+    uint32_t *fault_dir, *frameref_table, *frameref, disk_offset, block_count;
+    uint32_t info_mode, mode, disk_loc, *entry, npages = 1, npages_busy;
+    uint32_t cow_mode  = PE_P | PE_US | PE_COW;
+    int      swap_slot = SWAP_NO_SLOT;
+    bool     image_page, zero_fill = false;
+    rmap_t   cache_map;
+
+    vaddr      &= PE_BASE_ADDR_MASK;
+    fault_dir   = pcb->page_directory;
+    disk_offset = (vaddr - PROCESS_VADDR) / PAGE_SIZE;
+    disk_offset *= (PAGE_SIZE / SECTOR_SIZE);
+
     mode = PE_P | PE_RW | PE_US;
     if (pcb->is_thread) {
         //info_mode = PE_INFO_PINNED; 
@@ -1231,10 +2457,113 @@ int load_page_from_disk(uint32_t vaddr, pcb_t *pcb)
         info_mode |= PE_INFO_PINNED; // Add the pinned flag for processes with pid 11
     }
 
+    // Only this process adds tables to its directory
+    frameref_table = ptable_fault_in(pcb, vaddr);
+    // for mapping the page from the page cache, if it is there
+    cache_map = rmap_get();
+
+    lock_acquire(&pcb->vmem_lock);
+    entry = get_page_table_entry(vaddr, fault_dir);
+    // the page is being written out or read in, wait for it
+    while (*entry & PE_BUSY) condition_wait(&pcb->vmem_lock, &pcb->vmem_busy);
+    // another thread brought the page in, and counted the fault for it
+    if (*entry & PE_P) {
+        lock_release(&pcb->vmem_lock);
+        rmap_put(cache_map);
+        return 0;
+    }
+
+    // evicted a moment ago and the frame not reused yet
+    nointerrupt_enter();
+    frame_t standby_frame = standby_lookup(pcb->pid, vaddr);
+    if (standby_frame != FRAME_NONE) {
+        standby_page_map(standby_frame, cache_map, pcb, vaddr, info_mode);
+        nointerrupt_leave();
+        lock_release(&pcb->vmem_lock);
+        pcb->minor_fault_count++;
+        return 0;
+    }
+    nointerrupt_leave();
+
+    if (*entry & PE_SWAPPED) {
+        // the page was dirty when evicted, read it back from swap
+        swap_slot   = *entry >> PE_BASE_ADDR_BITS;
+        disk_loc    = swap_slot_sector(swap_slot);
+        block_count = SECTORS_PER_PAGE;
+    } else if (user_stack_page(vaddr)) {
+        // stack pages start out zero, there is nothing to read
+        zero_fill  = true;
+        info_mode |= PE_INFO_STACK;
+        disk_loc   = 0;
+    } else if (user_bss_page(pcb, vaddr)) {
+        // bss past the end of the image reads as zero until written
+        nointerrupt_enter();
+        table_map_page(frameref_table, vaddr, (uint32_t) shared_zero_page, cow_mode);
+        if (MEMDEBUG) {
+            pr_log("load_page_from_disk: pid %u maps the zero page at 0x%08x\n",
+                   pcb->pid, vaddr);
+        }
+        nointerrupt_leave();
+        lock_release(&pcb->vmem_lock);
+        rmap_put(cache_map);
+        pcb->minor_fault_count++;
+        return 0;
+    } else {
+        assertk(disk_offset < pcb->swap_size);
+
+        // Compute the actual disk location by adding the swap location
+        disk_loc = pcb->swap_loc + disk_offset;
+
+        // another process started from the same image may have the page
+        nointerrupt_enter();
+        frame_t cached = page_cache_lookup(disk_loc);
+        if (cached != FRAME_NONE) {
+            rmap_link(cached, cache_map, pcb, vaddr, info_mode);
+            frame_flags[cached] &= ~PE_INFO_PREFETCHED;
+            table_map_page(frameref_table, vaddr, (uint32_t) frame_paddr(cached), cow_mode);
+            if (MEMDEBUG) {
+                pr_log("load_page_from_disk: pid %u shares cached page 0x%08x at 0x%08x\n",
+                       pcb->pid, (uint32_t) frame_paddr(cached), vaddr);
+            }
+            nointerrupt_leave();
+            lock_release(&pcb->vmem_lock);
+            pcb->minor_fault_count++;
+            return 0;
+        }
+        nointerrupt_leave();
+
+        npages = fault_around_pages(pcb, vaddr);
+    }
+    image_page  = swap_slot == SWAP_NO_SLOT && !zero_fill;
+    npages_busy = npages;
+    page_set_busy(frameref_table, vaddr, npages_busy, 1);
+    lock_release(&pcb->vmem_lock);
+    rmap_put(cache_map);
+
+    if (MEMDEBUG) {
+        nointerrupt_enter();
+        load_page_pr_log(pcb->pid, (void *) vaddr, disk_offset, pcb->swap_size);
+        nointerrupt_leave();
+    }
+
+    // a process at its quota makes room among its own pages
+    while (pcb->rss >= pcb->rss_quota && rss_trim(pcb)) {
+    }
+
     int success = -1;
-    //lock_acquire(&page_map_lock);
-    frameref = allocate_page();
-    //lock_release(&page_map_lock);
+    // pages read ahead have to be physically contiguous to be read in one
+    // transfer, without such frames only the faulting page is read
+    frameref = NULL;
+    if (npages > 1) {
+        nointerrupt_enter();
+        frameref = take_free_frame_run(&npages);
+        nointerrupt_leave();
+    }
+    if (!frameref) {
+        npages = 1;
+        // no need to zero the frame if the read overwrites it
+        frameref = allocate_frame(zero_fill);
+    }
 
     if (!frameref) {
         nointerrupt_enter();
@@ -1242,41 +2571,74 @@ int load_page_from_disk(uint32_t vaddr, pcb_t *pcb)
         nointerrupt_leave();
         abortk();
     } else {
-        invalidate_page((uintptr_t *) vaddr);
-        success = disk_loader(disk_loc, block_count, frameref);
-        invalidate_page((uintptr_t *) vaddr);
-    }
+        if (image_page) {
+            // Determine the number of sectors to read, ensuring not to exceed file boundaries
+            block_count = MIN(npages * SECTORS_PER_PAGE, pcb->swap_size - disk_offset);
+        }
 
-    //lock_acquire(&page_map_lock);
-    frameref_table = get_page_table(vaddr, fault_dir);
-    if (frameref_table == NULL) {
-        frameref_table = allocate_page();
-        insert_page_frame_info(frameref_table, (uintptr_t *) vaddr, pcb, info_mode);
-        inc_pinned_pages(1);
-        dir_ins_table(fault_dir, vaddr, frameref_table, mode);
+        // nothing may map or evict the frames until the read is done
+        for (uint32_t i = 0; i < npages; i++) {
+            insert_page_frame_info(
+                    page_frame_at(frameref, i), (uintptr_t *) (vaddr + i * PAGE_SIZE), pcb,
+                    info_mode | PE_INFO_IN_TRANSIT | (i ? PE_INFO_PREFETCHED : 0)
+            );
+        }
+
+        if (zero_fill || (swap_slot != SWAP_NO_SLOT && zswap_load(swap_slot, frameref))) {
+            success = 0;
+            pcb->minor_fault_count++;
+        } else {
+            success = disk_loader(disk_loc, block_count, frameref, npages);
+            pcb->major_fault_count++;
+        }
     }
 
+    lock_acquire(&pcb->vmem_lock);
     if (success < 0) {
         pr_error("load_page_from_disk: Failed to read from disk sector %u\n", disk_loc);
-        lock_release(&page_map_lock);
+        for (uint32_t i = 0; i < npages; i++) {
+            page_clear_info(page_frame_at(frameref, i));
+            nointerrupt_enter();
+            add_page_frame_to_free_list_info(page_frame_at(frameref, i));
+            nointerrupt_leave();
+        }
+        page_set_busy(frameref_table, vaddr, npages_busy, 0);
+        condition_broadcast(&pcb->vmem_busy);
+        lock_release(&pcb->vmem_lock);
         return success;
     }
 
-    if ( !(info_mode & PE_INFO_PINNED) && EVICTION_STRATEGY == EVICTION_STRATEGY_FIFO) {
-        fifo_enqueue_info(frameref);
+    nointerrupt_enter();
+    // keep the slot while the page stays clean, so it can be dropped
+    // again without a write
+    frame_swap_slot[frame_index(frameref)] = swap_slot;
+
+    for (uint32_t i = 0; i < npages; i++) {
+        uint32_t *frame = page_frame_at(frameref, i);
+        uint32_t  next  = vaddr + i * PAGE_SIZE;
+        if (!(info_mode & PE_INFO_PINNED) && EVICTION_STRATEGY == EVICTION_STRATEGY_FIFO) {
+            fifo_enqueue_info(frame);
+        }
+        frame_flags[frame_index(frame)] &= ~PE_INFO_IN_TRANSIT;
+        // image pages are shared read-only until written, unless someone
+        // cached the same page while we were reading it
+        if (image_page
+            && page_cache_insert(frame_index(frame), disk_loc + i * SECTORS_PER_PAGE)) {
+            table_map_page(frameref_table, next, (uint32_t) frame, cow_mode);
+        } else {
+            table_map_page(frameref_table, next, (uint32_t) frame, mode);
+        }
     }
-    insert_page_frame_info(frameref, (uintptr_t *) vaddr, pcb, info_mode); 
-    table_map_page(frameref_table, vaddr, (uint32_t) frameref, mode);
-    dir_ins_table(fault_dir, vaddr, frameref_table, mode);
+    nointerrupt_leave();
 
-    invalidate_page((uintptr_t *) vaddr);
-    //////set_page_directory(pcb->page_directory); // caused the bad data bug together with not
-    // having the page invalidation
-    //lock_release(&page_map_lock);
+    // pages we could not find frames for are left for a later fault
+    page_set_busy(frameref_table, vaddr + npages * PAGE_SIZE, npages_busy - npages, 0);
+    condition_broadcast(&pcb->vmem_busy);
+    lock_release(&pcb->vmem_lock);
 
     nointerrupt_enter();
-    pr_log("load_page_from_disk: Loaded page at virtual address 0x%08x with disk offset 0x%08x = %u from disk into physical address 0x%08x for pid = %u\n",
-           vaddr, disk_offset, disk_offset, (uint32_t) frameref, pcb -> pid);
+    pr_log("load_page_from_disk: Loaded page at virtual address 0x%08x with disk offset 0x%08x = %u from disk into physical address 0x%08x for pid = %u (%u pages read)\n",
+           vaddr, disk_offset, disk_offset, (uint32_t) frameref, pcb -> pid, npages);
     nointerrupt_leave();
 
     return success;
@@ -1290,87 +2652,334 @@ int load_page_from_disk(uint32_t vaddr, pcb_t *pcb)
  */
 int page_frame_check_dirty(uintptr_t *paddr)
 {
-    uint32_t           info_index, *current_pdir, vaddr;
-    page_frame_info_t *info_frame;
+    frame_t frame = frame_index(paddr);
+    int     dirty = 0;
 
-    info_index = calculate_info_index(paddr);
-    info_frame = &page_frame_info[info_index];
-    int dirty  = 0;
+    if (frame_flags[frame] & PE_INFO_KERNEL_DUMMY) {
+        // trying to evict kernel page dir
+        // frame should be pinned and this should never happen!
+        nointerrupt_enter();
+        pr_error("Trying to evict kernel page directory \n");
+        nointerrupt_leave();
+        return -1;
+    }
 
-    while (info_frame && info_frame->owner) {
-        current_pdir = info_frame->owner->page_directory;
-        vaddr        = (uint32_t) info_frame->vaddr;
+    for (rmap_t r = frame_rmap[frame]; r != RMAP_NONE; r = rmap_entry(r)->next) {
+        struct rmap *map = rmap_entry(r);
+        dirty += is_page_dirty(map->vaddr, map->owner->page_directory);
+    }
 
-        if (!(info_frame->info_mode & PE_INFO_KERNEL_DUMMY)) {
-            dirty += is_page_dirty(vaddr, current_pdir);
-        } else {
-            // trying to evict kernel page dir
-            // frame should be pinned and this should never happen!
-            nointerrupt_enter();
-            pr_error("Trying to evict kernel page directory \n");
-            nointerrupt_leave();
-            return -1;
-        }
+    return dirty;
+}
+
+/*
+ * First half of evicting the page frame 'paddr', chosen by
+ * select_page_for_eviction(). Called with interrupts disabled.
+ *
+ * Checks the frame for dirtiness, gives a dirty page a swap slot and marks
+ * the page table entries of all its mappings PE_BUSY. If 'flush' is not
+ * set the TLB entries are left for the caller to flush. Returns whether
+ * the page has to be written to swap.
+ */
+static int evict_prepare(uintptr_t *paddr, int flush)
+{
+    frame_t      frame = frame_index(paddr);
+    struct rmap *main  = rmap_entry(frame_rmap[frame]);
+    int          dirty;
+
+    if (frame_flags[frame] & PE_INFO_PINNED) {
+        pr_error("try_to_evict: suggested evicting pinned page\n");
+        abortk();
+    }
+    if (frame_flags[frame] & PE_INFO_KERNEL_DUMMY) {
+        pr_error("try_to_evict: suggested evicting kernel page\n");
+        abortk();
+    }
+    if (frame_flags[frame] & PE_INFO_IN_TRANSIT) {
+        pr_error("try_to_evict: suggested evicting page being read from disk\n");
+        abortk();
+    }
 
-        info_frame = info_frame->next_shared_info;
+    if ((frame_flags[frame] & PE_INFO_PREFETCHED)
+        && !(clock_collect_bits(frame, 0) & PE_A)) {
+        fault_around_shrink(main->owner);
     }
 
+    // check if page frame is dirty, dirty pages go to swap
+    dirty = page_frame_check_dirty(paddr);
+    if (dirty) {
+        // a slot some page table entry still refers to must not change
+        if (frame_swap_slot[frame] != SWAP_NO_SLOT && swap_shared(frame_swap_slot[frame])) {
+            swap_free(frame_swap_slot[frame]);
+            frame_swap_slot[frame] = SWAP_NO_SLOT;
+        }
+        if (frame_swap_slot[frame] == SWAP_NO_SLOT) {
+            frame_swap_slot[frame] = swap_alloc();
+        }
+        if (frame_swap_slot[frame] == SWAP_NO_SLOT) {
+            pr_error("try_to_evict: out of swap space\n");
+            abortk();
+        }
+    }
+
+    // from here on faults on the page wait for the write to finish
+    frame_flags[frame] |= PE_INFO_IN_TRANSIT;
+    for (rmap_t r = frame_rmap[frame]; r != RMAP_NONE; r = rmap_entry(r)->next) {
+        struct rmap *map = rmap_entry(r);
+        page_set_entry(map->owner->page_directory, map->vaddr, PE_BUSY, flush);
+        pgtrace_record(dirty ? PGTRACE_EVICT_DIRTY : PGTRACE_EVICT, map->owner->pid, map->vaddr);
+    }
     return dirty;
 }
 
+/*
+ * Second half of evicting 'paddr', called without any locks held. Hands
+ * a dirty page to zswap, or writes it to its swap slot, and lets
+ * page_free() point the page table entries to where the page can be found
+ * again. With 'standby' set the frame is left to page_free(), otherwise it
+ * is the caller's.
+ */
+static void evict_finish(uintptr_t *paddr, int dirty, bool standby)
+{
+    frame_t frame = frame_index(paddr);
+
+    if (dirty && !zswap_store(frame_swap_slot[frame], paddr)) {
+        struct rmap *main = rmap_entry(frame_rmap[frame]);
+        write_page_to_swap(main->vaddr, main->owner, paddr, frame_swap_slot[frame]);
+    }
+
+    // resets the info data and points the page table entries
+    // of all the page directories referencing it to the page's
+    // new home
+    page_free(paddr, standby ? PAGE_FREE_STANDBY : PAGE_FREE_EVICT);
+}
+
 /*
  *  Returns a physical address to an evicted page frame
+ *
+ *  The victim is chosen, checked for dirtiness and unmapped with its page
+ *  table entries marked PE_BUSY, all with interrupts disabled. A dirty page
+ *  is then written to swap without holding any lock, and page_free() lets
+ *  the entries point to where the page can be found again.
  */
 uint32_t *try_evict_page_v2()
 {
-    uintptr_t         *page_frame_ref = NULL; // physical page frame
-    uint32_t           info_index;
-    page_frame_info_t *frame_info;
+    uintptr_t *page_frame_ref = NULL; // physical page frame
+    int        dirty;
+
+    nointerrupt_enter();
 
     // index into information structs array relating
     // physical addresses to processes and the
     // relevant virtual address
     if (!(page_frame_ref = select_page_for_eviction())) {
-        nointerrupt_enter();
         pr_error("try_to_evict: No suitable page found for eviction\n");
         nointerrupt_leave();
         return NULL;
     }
 
-    info_index = calculate_info_index(page_frame_ref);
-    frame_info = &page_frame_info[info_index];
+    dirty = evict_prepare(page_frame_ref, 1);
+    nointerrupt_leave();
 
-    if (frame_info->info_mode & PE_INFO_PINNED) {
-        nointerrupt_enter();
-        pr_error("try_to_evict: suggested evicting pinned page\n");
+    evict_finish(page_frame_ref, dirty, false);
+    return page_frame_ref;
+}
+
+/*
+ * Evicts up to 'want' pages in one go and puts their frames on the standby
+ * or free list. The victims are all chosen and unmapped first, with a
+ * single TLB flush for the lot, then the dirty ones are written out back
+ * to back. Returns the number of frames freed.
+ */
+static uint32_t reclaim_batch(uint32_t want)
+{
+    uintptr_t *victim[RECLAIM_BATCH_PAGES];
+    int        dirty[RECLAIM_BATCH_PAGES];
+    uint32_t   n = 0;
+
+    want = MIN(want, RECLAIM_BATCH_PAGES);
+
+    nointerrupt_enter();
+    while (n < want && (victim[n] = select_page_for_eviction())) {
+        dirty[n] = evict_prepare(victim[n], 0);
+        n++;
+    }
+    if (n) flush_tlb();
+    nointerrupt_leave();
+
+    for (uint32_t i = 0; i < n; i++) evict_finish(victim[i], dirty[i], true);
+
+    if (MEMDEBUG && n) {
+        pr_log("reclaim: evicted %u pages, %u frames free, %u on standby\n", n,
+               free_page_count, standby_page_count);
+    }
+    return n;
+}
+
+/* Set or clear the dirty bit of every present mapping of 'frame' */
+static void frame_set_dirty(frame_t frame, bool dirty)
+{
+    for (rmap_t r = frame_rmap[frame]; r != RMAP_NONE; r = rmap_entry(r)->next) {
+        struct rmap *map   = rmap_entry(r);
+        uint32_t    *entry = get_page_table_entry(map->vaddr, map->owner->page_directory);
+        if (!entry || !(*entry & PE_P)) continue;
+
+        *entry = dirty ? *entry | PE_D : *entry & ~PE_D;
+        invalidate_page((uintptr_t *) map->vaddr);
+    }
+}
+
+/*
+ * Writes the dirty page in 'frame' to its swap slot while it stays mapped,
+ * so that it can be evicted later without waiting for the write. The
+ * dirty bits are cleared before the write, a write to the page during it
+ * sets them again and the page stays dirty. Does nothing if the frame is
+ * no longer an eviction candidate or clean. Called without any locks held.
+ */
+static void page_clean(frame_t frame)
+{
+    nointerrupt_enter();
+    if (!clock_is_candidate(frame, NULL) || !(clock_collect_bits(frame, 0) & PE_D)) {
         nointerrupt_leave();
-        abortk();
+        return;
     }
-    if (frame_info->info_mode & PE_INFO_KERNEL_DUMMY) {
-        nointerrupt_enter();
-        pr_error("try_to_evict: suggested evicting kernel page\n");
+    // a slot some page table entry still refers to must not change
+    if (frame_swap_slot[frame] != SWAP_NO_SLOT && swap_shared(frame_swap_slot[frame])) {
+        swap_free(frame_swap_slot[frame]);
+        frame_swap_slot[frame] = SWAP_NO_SLOT;
+    }
+    if (frame_swap_slot[frame] == SWAP_NO_SLOT) frame_swap_slot[frame] = swap_alloc();
+    if (frame_swap_slot[frame] == SWAP_NO_SLOT) {
+        // eviction will find out, leave the page as it is
         nointerrupt_leave();
-        abortk();
+        return;
     }
 
+    // keeps it from being evicted or freed during the write
+    frame_flags[frame] |= PE_INFO_IN_TRANSIT;
+    frame_set_dirty(frame, false);
+    struct rmap *main = rmap_entry(frame_rmap[frame]);
+    uint32_t     vaddr = main->vaddr;
+    pcb_t       *owner = main->owner;
+    int          slot  = frame_swap_slot[frame];
+    nointerrupt_leave();
+
+    // the pool may have an older version of the page for the slot
+    zswap_invalidate(slot);
+    int success = write_page_to_swap(vaddr, owner, frame_paddr(frame), slot);
 
-    uint32_t vaddr = (uint32_t) frame_info->vaddr;
+    nointerrupt_enter();
+    frame_flags[frame] &= ~PE_INFO_IN_TRANSIT;
+    if (success < 0) frame_set_dirty(frame, true);
+    nointerrupt_leave();
 
-    if (frame_info -> owner == current_running) {
-        invalidate_page((uintptr_t *) vaddr);
+    if (success < 0) pr_error("page_clean: failed to write frame %u to swap\n", frame);
+}
+
+/* Writes the pages queued by WSClock to swap */
+static void wsclock_clean(void)
+{
+    while (1) {
+        nointerrupt_enter();
+        if (!wsclock_writeback_count) {
+            nointerrupt_leave();
+            return;
+        }
+        frame_t frame = wsclock_writeback[--wsclock_writeback_count];
+        nointerrupt_leave();
+
+        page_clean(frame);
     }
+}
 
-    // check if page frame is dirty
-    if (page_frame_check_dirty(page_frame_ref)) {
-        write_page_back_to_disk(vaddr, frame_info->owner, frame_info->paddr);
+/*
+ * Evicts one of the pages of 'pcb' mapped by it alone, onto the standby
+ * list, to bring it toward its resident set quota or to swap it out while
+ * it is suspended. Returns false if it has no page to give up.
+ */
+bool rss_trim(pcb_t *pcb)
+{
+    if (EVICTION_STRATEGY != EVICTION_STRATEGY_CLOCK
+        && EVICTION_STRATEGY != EVICTION_STRATEGY_WSCLOCK) {
+        return false;
     }
 
-    // puts this page frame back in the free list,
-    // resets the info data and invalidates the page frame
-    // in all the page directories referencing it.
-    page_free(frame_info->paddr, 1);
+    nointerrupt_enter();
+    uintptr_t *victim = clock_select(&pcb->clock_hand, pcb);
+    int        dirty  = victim ? evict_prepare(victim, 1) : 0;
+    nointerrupt_leave();
 
-    return page_frame_ref;
+    if (!victim) return false;
+    evict_finish(victim, dirty, true);
+    return true;
+}
+
+/*
+ * Page-fault-frequency control of the resident set quotas, run every
+ * PFF_INTERVAL millisecs. A process faulting often gets a larger quota, one
+ * that hardly faults a smaller one and is trimmed down to it.
+ */
+static void pff_adjust(void)
+{
+    uint32_t quota_max = MIN(RSS_QUOTA_MAX, frame_count / 2);
+
+    for (pcb_t *p = pcb; p < pcb + PCB_TABLE_SIZE; p++) {
+        nointerrupt_enter();
+        if (p->pid == 0 || p->is_thread || p->status == STATUS_EXITED) {
+            nointerrupt_leave();
+            continue;
+        }
+        p->fault_rate      = p->page_fault_count - p->pff_fault_count;
+        p->pff_fault_count = p->page_fault_count;
+        if (p->fault_rate > PFF_HIGH_FAULTS) {
+            p->rss_quota = MIN(p->rss_quota + PFF_STEP_PAGES, quota_max);
+        } else if (p->fault_rate < PFF_LOW_FAULTS) {
+            p->rss_quota = p->rss_quota > RSS_QUOTA_MIN + PFF_STEP_PAGES
+                                   ? p->rss_quota - PFF_STEP_PAGES
+                                   : RSS_QUOTA_MIN;
+        }
+        nointerrupt_leave();
+
+        while (p->rss > p->rss_quota && rss_trim(p)) {
+        }
+    }
+}
+
+/*
+ * Keeps free frames available ahead of demand. When the number of free
+ * frames drops below the low watermark, pages are evicted in batches until
+ * it is back at the high watermark, so that a fault rarely has to evict
+ * and wait for a write to swap itself. Also runs the page-fault-frequency
+ * control of the resident set quotas and load control, cleans the pages
+ * queued by WSClock and drains the page trace.
+ */
+void page_reclaim_thread(void)
+{
+    // watermarks scale down for small memories, leaving room to run in
+    uint32_t low  = MIN(RECLAIM_LOW_PAGES, frame_count / 8);
+    uint32_t high = MIN(RECLAIM_HIGH_PAGES, frame_count / 4);
+
+    uint64_t pff_ticks = (uint64_t) PFF_INTERVAL * 1000 * cpu_mhz;
+    uint64_t pff_next  = read_cpu_ticks() + pff_ticks;
+
+    // standby frames are as good as free, they just remember a page
+    while (1) {
+        if (read_cpu_ticks() >= pff_next) {
+            pff_adjust();
+            loadctl_update();
+            pff_next = read_cpu_ticks() + pff_ticks;
+        }
+        wsclock_clean();
+        pgtrace_flush();
+        if (free_page_count + standby_page_count < low) {
+            while (free_page_count + standby_page_count < high
+                   && reclaim_batch(high - free_page_count - standby_page_count)) {
+                yield();
+            }
+            loadctl_wakeup();
+        }
+        msleep(RECLAIM_THREAD_SLEEP);
+    }
 }
 
 
@@ -1381,7 +2990,7 @@ uint32_t *try_evict_page()
 }
 
 
-inline void log_interrupt_frame(struct interrupt_frame *stack_frame)
+static inline void log_interrupt_frame(struct interrupt_frame *stack_frame)
 {
    pr_log("instruction pointer:     %08x\n", stack_frame -> ip);
    pr_log("code segment selector:   %08x\n", stack_frame -> cs);
@@ -1391,6 +3000,87 @@ inline void log_interrupt_frame(struct interrupt_frame *stack_frame)
    pr_log("stack segment selector:  %08x\n", stack_frame -> ss);
 }
 
+/* Whether 'vaddr' is mapped read-only to a shared page in 'pcb' */
+static bool page_is_cow(uint32_t vaddr, pcb_t *pcb)
+{
+    uint32_t *entry = get_page_table_entry(vaddr, pcb->page_directory);
+    return entry && (*entry & (PE_P | PE_COW)) == (PE_P | PE_COW);
+}
+
+/*
+ * Handles a write to a page mapped with PE_COW. A process that is the only
+ * one mapping the frame takes it over, others get a copy of their own.
+ * Either way the frame it ends up with is private and writable. The zero
+ * page is never taken over and is not in any reverse map.
+ */
+static void cow_page_fault(uint32_t vaddr, pcb_t *pcb)
+{
+    uint32_t *entry, *copy, info_mode = PE_INFO_USER_MODE;
+    bool      zeroed;
+    rmap_t    r;
+
+    vaddr &= PE_BASE_ADDR_MASK;
+    if (pcb->pid == first_process_pid && PIN_SHELL) info_mode |= PE_INFO_PINNED;
+
+    // allocating can evict, so do it before taking the lock. A copy of
+    // the zero page had better come from the pool of zeroed frames.
+    entry  = get_page_table_entry(vaddr, pcb->page_directory);
+    zeroed = entry && (*entry & PE_BASE_ADDR_MASK) == (uint32_t) shared_zero_page;
+    copy   = allocate_frame(zeroed);
+    r      = rmap_get();
+
+    lock_acquire(&pcb->vmem_lock);
+    entry = get_page_table_entry(vaddr, pcb->page_directory);
+    while (entry && (*entry & PE_BUSY)) {
+        condition_wait(&pcb->vmem_lock, &pcb->vmem_busy);
+    }
+
+    nointerrupt_enter();
+    // the page may have been evicted while we allocated, then the write
+    // faults again and reads it in
+    if (entry && (*entry & (PE_P | PE_COW)) == (PE_P | PE_COW)) {
+        frame_t frame = frame_index((uintptr_t *) (*entry & PE_BASE_ADDR_MASK));
+        bool    zero  = frame_paddr(frame) == shared_zero_page;
+        rmap_t  head  = frame_rmap[frame];
+
+        if (!zero && rmap_entry(head)->next == RMAP_NONE) {
+            // nobody else maps it, it need not stay in the cache
+            page_cache_remove(frame);
+            *entry = (*entry | PE_RW) & ~PE_COW;
+        } else {
+            if (!zero) {
+                memcpy(copy, frame_paddr(frame), PAGE_SIZE);
+                rmap_t mine = rmap_unlink(frame, pcb, vaddr);
+                assertk(mine != RMAP_NONE);
+                rmap_release(mine);
+            } else if (!zeroed) {
+                page_zero(copy);
+            }
+            rmap_link(frame_index(copy), r, pcb, vaddr, info_mode);
+            if (!(info_mode & PE_INFO_PINNED) && EVICTION_STRATEGY == EVICTION_STRATEGY_FIFO) {
+                fifo_enqueue_info(copy);
+            }
+            *entry = (uint32_t) copy | PE_P | PE_RW | PE_US;
+            copy   = NULL;
+            r      = RMAP_NONE;
+        }
+        invalidate_page((uint32_t *) vaddr);
+        if (MEMDEBUG) {
+            pr_log("cow_page_fault: pid %u %s page at 0x%08x\n", pcb->pid,
+                   copy ? "took over" : "copied", vaddr);
+        }
+    }
+    nointerrupt_leave();
+    lock_release(&pcb->vmem_lock);
+
+    if (copy) {
+        nointerrupt_enter();
+        add_page_frame_to_free_list_info(copy);
+        nointerrupt_leave();
+    }
+    if (r != RMAP_NONE) rmap_put(r);
+}
+
 /*
  * Comment author: Eindride Kjersheim
  * Error code bits, from Intel i386 manual page 170.
@@ -1417,6 +3107,10 @@ inline void log_interrupt_frame(struct interrupt_frame *stack_frame)
 // control wether multiple page faults should be handled at once or queued up
 lock_t page_fault_debug_lock = LOCK_INIT;
 
+/* Time spent reading pages in on page faults, in microseconds */
+static uint32_t page_in_count;
+static uint32_t page_in_usecs;
+
 /*
  * Handle page fault
  */
@@ -1427,6 +3121,13 @@ void page_fault_handler(struct interrupt_frame *stack_frame, ureg_t error_code)
     invalidate_page(fault_address);
     pcb_t *fault_pcb = current_running;
     fault_pcb -> page_fault_count++;
+    pgtrace_record(ec_write(error_code) ? PGTRACE_WRITE : PGTRACE_READ, fault_pcb->pid,
+                   (uint32_t) fault_address);
+
+    if (kstack_guard((uint32_t) fault_address)) {
+        pr_error("page_fault_handler: pid %u overflowed its kernel stack\n", fault_pcb->pid);
+        abortk();
+    }
 
     if (MEMDEBUG) {
         pr_log("\n\n\n\n\n\n\n");
@@ -1444,10 +3145,14 @@ void page_fault_handler(struct interrupt_frame *stack_frame, ureg_t error_code)
         pr_log("page_fault_handler: fault directory 0x%013x \n", (uint32_t)fault_directory);
         pr_log("page_fault_handler: fault_pcb -> page_directory 0x%013x \n", (uint32_t)fault_pcb->page_directory);
 
-        pr_log("PAGING_AREA_MAX_PADDR = 0x%013x\n", PAGING_AREA_MAX_PADDR);
+        pr_log("paging_area_end = 0x%013x\n", paging_area_end);
     }
 
-    if (ec_privilige_violation(error_code)) {
+    // a write to a shared page, user mode or from a system call
+    bool cow = ec_privilige_violation(error_code) && ec_write(error_code)
+               && page_is_cow((uint32_t) fault_address, fault_pcb);
+
+    if (ec_privilige_violation(error_code) && !cow) {
         // abort - access violation
         pr_error("page_fault_handler: privilege error, virtual address: %p \n", fault_address);
         abortk();
@@ -1467,15 +3172,40 @@ void page_fault_handler(struct interrupt_frame *stack_frame, ureg_t error_code)
 
     //lock_acquire(&page_map_lock);
 
+    // anything outside the image and the stack is off limits
+    uint32_t vaddr = (uint32_t) fault_address;
+    if (!cow && !fault_pcb->is_thread && !user_image_page(fault_pcb, vaddr)
+        && !user_stack_page(vaddr)) {
+        pr_error("page_fault_handler: pid %u %s at 0x%08x, killing it\n", fault_pcb->pid,
+                 user_stack_guard(vaddr) ? "overflowed its stack" : "touched unmapped memory",
+                 vaddr);
+        exit();
+    }
+
     nointerrupt_leave();
 
+    if (cow) {
+        cow_page_fault((uint32_t) fault_address, fault_pcb);
+        fault_pcb->minor_fault_count++;
+        nointerrupt_enter();
+        return;
+    }
+
     //lock_acquire(&page_fault_debug_lock);
-    lock_acquire(&page_map_lock);
+    uint64_t page_in_start = read_cpu_ticks();
+    // load_page_from_disk takes the locks it needs, none are held across
+    // the disk transfer
     int success = load_page_from_disk((uint32_t) fault_address, fault_pcb);
-    lock_release(&page_map_lock);
+    uint32_t page_in_time = (uint32_t) ((read_cpu_ticks() - page_in_start) / cpu_mhz);
     //lock_release(&page_fault_debug_lock);
 
     nointerrupt_enter();
+    page_in_count++;
+    page_in_usecs += page_in_time;
+    if (MEMDEBUG) {
+        pr_log("page_fault_handler: page-in took %u us, average %u us over %u faults\n",
+               page_in_time, page_in_usecs / page_in_count, page_in_count);
+    }
     if (success >= 0) {
         pr_log(
                 "page_fault_handler: loaded page from disk into memory for pid %u,  with page fault count %u\n\n",
@@ -1486,6 +3216,5 @@ void page_fault_handler(struct interrupt_frame *stack_frame, ureg_t error_code)
 
     todo_use(stack_frame);
     todo_use(error_code);
-    todo_use(page_map_lock);
     todo_abort();
 }
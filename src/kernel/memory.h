@@ -25,6 +25,11 @@ enum {
     PE_PCD            = 1 << 4,     /* page cache disable */
     PE_A              = 1 << 5,     /* accessed */
     PE_D              = 1 << 6,     /* dirty */
+    PE_PS             = 1 << 7,     /* (directory) maps a 4MB page */
+    PE_G              = 1 << 8,     /* global, kept in the TLB on CR3 loads */
+    PE_SWAPPED        = 1 << 9,     /* (avail) not present, page in swap */
+    PE_BUSY           = 1 << 10,    /* (avail) not present, page in transit */
+    PE_COW            = 1 << 11,    /* (avail) read-only shared, copy on write */
     PE_BASE_ADDR_BITS = 12,         /* position of base address */
     PE_BASE_ADDR_MASK = 0xfffff000, /* extracts the base address */
 
@@ -40,12 +45,56 @@ enum {
     PAGE_TABLE_SIZE = (1024 * 4096 - 1), /* size of a page table in bytes */
 };
 
-/* Initialize the memory system, called from kernel.c: _start() */
-void init_memory(void);
+/* BIOS E820 memory map, left at MEMORY_MAP_PADDR by the bootblock */
+struct memory_map_entry {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi_attributes;
+} __attribute__((packed));
+
+struct memory_map {
+    uint32_t                count; /* 0 if the BIOS has no E820 support */
+    struct memory_map_entry entry[MEMORY_MAP_MAX_ENTRIES];
+} __attribute__((packed));
+
+enum {
+    MEMORY_MAP_USABLE = 1, /* entry type of RAM free for use */
+};
+
+/*
+ * Initialize the memory system, called from kernel.c: kernel_main(). Pages
+ * the usable RAM in 'map'.
+ */
+void init_memory(const struct memory_map *map);
+
+/* Number of pageable frames, known once init_memory() has run */
+uint32_t pageable_page_count(void);
+
+/*
+ * Evict one of the pages mapped by 'pcb' alone, to shrink its resident set.
+ * Returns false if it has no such page. Called without any locks held.
+ */
+bool rss_trim(pcb_t *pcb);
+
+/*
+ * Evict the page tables of the suspended process 'pcb' that map none of
+ * its resident pages. They are read back when it faults on them.
+ */
+void ptable_trim(pcb_t *pcb);
 
 /* Set up a page directory and page table for the process. */
 void setup_process_vmem(pcb_t *p);
 
+/* Free the pages, swap slots and page tables of the exited process 'p' */
+void free_process_vmem(pcb_t *p);
+
+/*
+ * Give 'child' a copy on write duplicate of the address space of 'parent',
+ * which must be the process running.
+ */
+void fork_process_vmem(pcb_t *parent, pcb_t *child);
+
 /*
  * Page fault handler, called from interrupt.c: exception_14().
  * Should handle demand paging
@@ -53,10 +102,31 @@ void setup_process_vmem(pcb_t *p);
 void page_fault_handler(
         struct interrupt_frame *stack_frame, ureg_t error_code
 );
+/* Kernel thread keeping a pool of free frames zeroed ahead of time */
+void page_zero_thread(void);
+
+/* Kernel thread evicting pages in batches when free frames run low */
+void page_reclaim_thread(void);
+
 /* Allocate a page for the kernel page directory and zero it out */
 
 uint32_t* allocate_page(void);
 
+/* Allocate a zeroed page for the kernel's own use, pinned for good */
+uint32_t *allocate_kernel_page(void);
+
+/*
+ * Allocate a kernel stack of T_KSTACK_SIZE_EACH bytes with an unmapped guard
+ * page below it, returns its lowest address or 0 if all are in use.
+ */
+uintptr_t kstack_alloc(void);
+
+/* Put the kernel stack at 'stack' on the free list for the next task */
+void kstack_free(uintptr_t stack);
+
+/* How many bytes of the kernel stack at 'stack' have been used */
+uint32_t kstack_high_water(uintptr_t stack);
+
 
 /* Utility function to map a single page */
 void identity_map_page(uint32_t* table, uint32_t vaddr, uint32_t mode);
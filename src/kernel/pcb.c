@@ -13,10 +13,12 @@
 #include "cpu.h"
 #include "hardware/intctl_8259.h"
 #include "interrupt.h"
+#include "loadctl.h"
 #include "memory.h"
 #include "pcb.h"
 #include "scheduler.h"
 #include "sync.h"
+#include "syscall.h"
 
 /* Required for dynamic loading */
 
@@ -25,9 +27,7 @@
 #include "usb/scsi.h"
 #include "usb/usb.h"
 
-#include "sleep.h"
 
-#include "stdlib.h"
 
 
 #include "config.h"
@@ -181,9 +181,12 @@ void queue_remove(struct pcb **q, struct pcb *p)
 pcb_t pcb[PCB_TABLE_SIZE];
 
 /* Used for allocation of pids, kernel stack, and pcbs */
-static pcb_t    *freelist   = NULL;
-static int       next_pid   = 0;
-static uintptr_t next_stack = T_KSTACK_AREA_MIN_PADDR;
+static pcb_t *freelist = NULL;
+static int    next_pid = 0;
+
+/* Exited tasks for the reaper, and the reaper waiting for them */
+static pcb_t *zombies        = NULL;
+static pcb_t *reaper_waiting = NULL;
 
 /* Initialize pcb table before allocating pcbs */
 void init_pcb_table(void)
@@ -202,14 +205,14 @@ void init_pcb_table(void)
     current_running             = NULL;
 }
 
-/* Get a free pcb */
+/* Get a free pcb, NULL if there is none */
 static pcb_t *alloc_pcb()
 {
-    pcb_t *p;
+    pcb_t *p = NULL;
     nointerrupt_enter();
-    assertf(freelist, "no free pcb structs");
-    p = queue_shift(&freelist);
+    if (freelist) p = queue_shift(&freelist);
     nointerrupt_leave();
+    if (!p) pr_error("no free pcb structs\n");
     return p;
 }
 
@@ -221,17 +224,60 @@ void free_pcb(pcb_t *p)
     nointerrupt_leave();
 }
 
-static void create_pcb_common(struct pcb *p)
+void pcb_reap(pcb_t *p)
+{
+    queue_insert(&zombies, p);
+    if (reaper_waiting) unblock(&reaper_waiting);
+}
+
+/*
+ * Frees what exited tasks leave behind: the address space of a process,
+ * the kernel stack and the pcb. The task can't do this itself, as it runs
+ * on that stack and page directory until the scheduler switches away.
+ */
+void reaper_thread(void)
+{
+    while (1) {
+        nointerrupt_enter();
+        while (!zombies) block(&reaper_waiting);
+        pcb_t *p = queue_shift(&zombies);
+        nointerrupt_leave();
+
+        free_process_vmem(p);
+
+        kstack_free(p->base_kernel_stack - T_KSTACK_START_OFFSET);
+        free_pcb(p);
+        loadctl_wakeup();
+    }
+}
+
+/*
+ * Get a pcb and a kernel stack for a new task, before the caller enters
+ * its critical section. Returns NULL, with neither taken, if either has
+ * run out.
+ */
+static pcb_t *alloc_pcb_and_stack(uintptr_t *stack)
+{
+    *stack = kstack_alloc();
+    if (!*stack) return NULL;
+
+    pcb_t *p = alloc_pcb();
+    if (!p) kstack_free(*stack);
+    return p;
+}
+
+/*
+ * Fill in the fields common to threads and processes. 'stack' is the
+ * kernel stack from alloc_pcb_and_stack().
+ */
+static void create_pcb_common(struct pcb *p, uintptr_t stack)
 {
     nointerrupt_enter();
     p->pid = next_pid++;
     nointerrupt_leave();
 
-    /* allocate kernel stack */
-    assertf(next_stack < T_KSTACK_AREA_MAX_PADDR, "Out of stack space");
-    p->kernel_stack = next_stack + T_KSTACK_START_OFFSET;
+    p->kernel_stack      = stack + T_KSTACK_START_OFFSET;
     p->base_kernel_stack = p->kernel_stack;
-    next_stack += T_KSTACK_SIZE_EACH;
 
     p->priority = 10;
     p->status = STATUS_FIRST_TIME;
@@ -239,20 +285,40 @@ static void create_pcb_common(struct pcb *p)
     p->preempt_count = 0;
     p->yield_count   = 0;
     p->page_fault_count = 0;
+    p->minor_fault_count = 0;
+    p->major_fault_count = 0;
+    p->fault_around      = FAULT_AROUND_INITIAL_PAGES;
+    p->rss               = 0;
+    p->rss_quota         = RSS_QUOTA_INITIAL;
+    p->clock_hand        = 0;
+    p->fault_rate        = 0;
+    p->pff_fault_count   = 0;
+    p->virtual_time      = 0;
+    p->dispatch_time     = 0;
+    p->suspend_requested = false;
+    p->suspended         = false;
+
+    p->vmem_lock = (lock_t) LOCK_INIT;
+    p->vmem_busy = (condition_t) CONDITION_INIT;
+    p->fault_around_next = 0;
 
     p->int_controller_mask = ~IRQS_TO_ENABLE;
 }
 
 /*
  * Allocate and set up the pcb for a new thread, allocate resources
- * for it and insert it into the ready queue.
+ * for it and insert it into the ready queue. Returns -1 if there is no
+ * pcb or kernel stack left for it.
  */
 int create_thread(uintptr_t start_addr)
 {
+    uintptr_t stack;
+    pcb_t    *p = alloc_pcb_and_stack(&stack);
+    if (!p) return -1;
+
     nointerrupt_enter();
 
-    pcb_t *p = alloc_pcb();
-    create_pcb_common(p);
+    create_pcb_common(p, stack);
 
     p->is_thread = true;
 
@@ -270,6 +336,7 @@ int create_thread(uintptr_t start_addr)
 
     p->swap_loc  = 0;
     p->swap_size = 0;
+    p->mem_size  = 0;
     /* Sets p->page_directory = &(created page directory) */
     setup_process_vmem(p);
 
@@ -277,53 +344,22 @@ int create_thread(uintptr_t start_addr)
     return 0;
 }
 
-static uint32_t first_process = 1;
-static uint32_t wait_load = 0;
 /*
  * Allocate and set up the pcb for a new process, allocate resources
- * for it and insert it into the ready queue.
+ * for it and insert it into the ready queue. Returns -1 if there is no
+ * pcb or kernel stack left for it.
  */
 
-int create_process(uint32_t location, uint32_t size)
+int create_process(uint32_t location, uint32_t size, uint32_t mem_size)
 {
+    uintptr_t stack;
+    pcb_t    *p = alloc_pcb_and_stack(&stack);
+    if (!p) return -1;
 
     lock_acquire(&load_process_lock_debug);
-    if (first_process) {
-        // initialize running_processes
-        running_processes = 0;
-        first_process = 0;
-    }
 
-    // this is a workaround for high paging activity causes the mailbox processes
-    // to get bad data. Most likely due to a bug in our code.
-    // Nevertheless a feature like this can increase system throughput 
-    // a lot by 'scheduling' process launching and avoids thrashing.
-    //////////////////////////////////////////////////////////////////////////////
-
-    // rough estimate - can be improved upon by using eg. p->swap_size for each
-    // process to estimate the number of pages used
-    if (SCHEDULE_PROCESS_LAUNCHING) {
-        uint32_t wait_counter = 0;
-        uint32_t page_space_available = PAGEABLE_PAGES - running_processes*AVERAGE_PAGES_PER_PROCESS;
-        while(page_space_available < AVERAGE_PAGES_PER_PROCESS + 1) {
-            pr_debug("create_process: too much competition for pages: sleeping while others finish\n");
-            pr_debug("create_process: too much competition for pages: currently %u processes running\n", running_processes);
-            page_space_available = PAGEABLE_PAGES - running_processes*AVERAGE_PAGES_PER_PROCESS;
-            wait_load = 1;
-            msleep(NEW_PROCESS_WAIT_TIME_FOR_PAGES);
-            wait_counter++;
-            if (wait_counter*NEW_PROCESS_WAIT_TIME_FOR_PAGES > 2000) {
-                lock_release(&load_process_lock_debug);
-                return 1;
-            }
-        }
-        // wait a random time to load a process that was put to sleep
-        if (wait_load) {
-            msleep(245 + (rand() % 420));
-            wait_load = 0;
-        }
-    }
-    //////////////////////////////////////////////////////////////////////////////
+    // wait until there is room for it, so that it does not thrash
+    loadctl_admit(mem_size);
 
     running_processes += 1;
     nointerrupt_enter();
@@ -331,8 +367,7 @@ int create_process(uint32_t location, uint32_t size)
     nointerrupt_leave();
 
     nointerrupt_enter();
-    pcb_t *p = alloc_pcb();
-    create_pcb_common(p);
+    create_pcb_common(p, stack);
 
     p->is_thread = false;
 
@@ -350,6 +385,7 @@ int create_process(uint32_t location, uint32_t size)
 
     p->swap_loc  = location;
     p->swap_size = size;
+    p->mem_size  = mem_size;
 
     nointerrupt_leave();
 
@@ -414,16 +450,71 @@ int readdir(unsigned char *buf)
 /*
  * Load a process from disk.
  *
- * Location is sector number on disk, size is number of sectors.
+ * Location is sector number on disk, size is number of sectors. The
+ * process has 'mem_size' sectors in memory, the ones past 'size' are bss.
  */
-int loadproc(int location, int size)
+int loadproc(int location, int size, int mem_size)
 {
     /*
      * With swap enabled, we no longer have to pre-load the process binary
      * from disk. We merely set up the mapping between memory and disk,
      * and let the page-fault handler swap pages in on demand.
      */
-    return create_process(location, size);
+    return create_process(location, size, mem_size);
+}
+
+/*
+ * Create a copy of the running process (exported as syscall).
+ *
+ * The child shares the parent's pages copy on write, so nothing is read
+ * from disk. It is dispatched straight into the return path of this
+ * syscall, on a copy of the parent's syscall frame, and sees fork()
+ * return 0. The parent gets the pid of the child, or -1 if there is no
+ * pcb or kernel stack left for it.
+ */
+int fork(void)
+{
+    pcb_t    *parent = current_running;
+    uintptr_t stack;
+    pcb_t    *p = alloc_pcb_and_stack(&stack);
+
+    if (!p) return -1;
+
+    nointerrupt_enter();
+    create_pcb_common(p, stack);
+
+    p->is_thread    = false;
+    p->nested_count = 0;
+    p->priority     = parent->priority;
+    p->user_stack   = parent->user_stack;
+    p->start_pc     = parent->start_pc;
+    p->cs           = parent->cs;
+    p->ds           = parent->ds;
+    p->swap_loc     = parent->swap_loc;
+    p->swap_size    = parent->swap_size;
+    p->mem_size     = parent->mem_size;
+    p->fault_around = parent->fault_around;
+    p->rss_quota    = parent->rss_quota;
+    nointerrupt_leave();
+
+    fork_process_vmem(parent, p);
+
+    /*
+     * Copy the user context the parent saved on entering the kernel, and
+     * below it the address dispatch() returns to
+     */
+    bcopy((char *) (parent->base_kernel_stack - SYSCALL_FRAME_SIZE),
+          (char *) (p->base_kernel_stack - SYSCALL_FRAME_SIZE), SYSCALL_FRAME_SIZE);
+    p->kernel_stack = p->base_kernel_stack - SYSCALL_FRAME_SIZE - sizeof(uint32_t);
+    *(uint32_t *) p->kernel_stack = (uint32_t) fork_child_entry;
+    p->status                     = STATUS_READY;
+
+    nointerrupt_enter();
+    running_processes += 1;
+    queue_insert(&current_running, p);
+    nointerrupt_leave();
+
+    return p->pid;
 }
 
 /* === Print Process Status Table === */
@@ -462,6 +553,11 @@ void print_pcb_table(void)
     static const int W_PREEMPT = 6;
     static const int W_YIELD   = 6;
     static const int W_PGFLT   = 5;
+    static const int W_MINFLT  = 5;
+    static const int W_MAJFLT  = 5;
+    static const int W_RSS     = 4;
+    static const int W_QUOTA   = 5;
+    static const int W_FLTRATE = 5;
     static const int W_KSTACK  = 5;
 
     tprintf(&procterm, "%*s", W_PID, "Pid");
@@ -470,6 +566,11 @@ void print_pcb_table(void)
     if (W_PREEMPT) tprintf(&procterm, " %*s", W_PREEMPT, "Pmpt");
     if (W_YIELD) tprintf(&procterm, " %*s", W_YIELD, "Yld");
     if (W_PGFLT) tprintf(&procterm, " %*s", W_PGFLT, "PgFlt");
+    if (W_MINFLT) tprintf(&procterm, " %*s", W_MINFLT, "Minor");
+    if (W_MAJFLT) tprintf(&procterm, " %*s", W_MAJFLT, "Major");
+    if (W_RSS) tprintf(&procterm, " %*s", W_RSS, "RSS");
+    if (W_QUOTA) tprintf(&procterm, " %*s", W_QUOTA, "Quota");
+    if (W_FLTRATE) tprintf(&procterm, " %*s", W_FLTRATE, "Flt/s");
     if (W_KSTACK) tprintf(&procterm, " %*s", W_KSTACK, "KStck");
     tprintf(&procterm, ANSIF_EL "\n", ANSI_EFWD); // Clear right, then newline
 
@@ -481,11 +582,21 @@ void print_pcb_table(void)
 
         tprintf(&procterm, "%*d", W_PID, p->pid);
         tprintf(&procterm, " %*s", W_TYPE, p->is_thread ? "Thrd" : "Proc");
-        tprintf(&procterm, " %*s", W_STATUS, status[p->status]);
+        tprintf(&procterm, " %*s", W_STATUS, p->suspended ? "Sus" : status[p->status]);
         if (W_PREEMPT) tprintf(&procterm, " %*d", W_PREEMPT, p->preempt_count);
         if (W_YIELD) tprintf(&procterm, " %*d", W_YIELD, p->yield_count);
         if (W_PGFLT) tprintf(&procterm, " %*d", W_PGFLT, p->page_fault_count);
-        if (W_KSTACK) tprintf(&procterm, " %*x", W_KSTACK, p->kernel_stack);
+        if (W_MINFLT) tprintf(&procterm, " %*d", W_MINFLT, p->minor_fault_count);
+        if (W_MAJFLT) tprintf(&procterm, " %*d", W_MAJFLT, p->major_fault_count);
+        if (W_RSS) tprintf(&procterm, " %*d", W_RSS, p->rss);
+        if (W_QUOTA) tprintf(&procterm, " %*d", W_QUOTA, p->rss_quota);
+        if (W_FLTRATE) {
+            tprintf(&procterm, " %*d", W_FLTRATE, p->fault_rate * 1000 / PFF_INTERVAL);
+        }
+        if (W_KSTACK) {
+            uintptr_t stack = p->base_kernel_stack - T_KSTACK_START_OFFSET;
+            tprintf(&procterm, " %*d", W_KSTACK, kstack_high_water(stack));
+        }
         tprintf(&procterm, ANSIF_EL "\n",
                 ANSI_EFWD); // Clear right, then newline
     }
@@ -5,6 +5,7 @@
 
 #include "hardware/intctl_8259.h"
 #include "interrupt.h"
+#include "sync.h"
 
 #define PCB_TABLE_SIZE 128
 
@@ -69,9 +70,25 @@ struct pcb {
     /* For virtual memory / paging */
 
     uint32_t *page_directory; /* Virtual memory page directory */
+    lock_t      vmem_lock; /* Serializes changes to this address space */
+    condition_t vmem_busy; /* Signalled when a PE_BUSY page settles */
     uint32_t swap_loc;         /* Swap space base address */
     uint32_t swap_size;        /* Size of this process */
+    uint32_t mem_size;         /* Size in memory, with zero-filled bss */
     uint32_t page_fault_count; /* Number of page faults */
+    uint32_t minor_fault_count; /* Faults served without reading the disk */
+    uint32_t major_fault_count; /* Faults that read the page from disk */
+    uint32_t fault_around;      /* Pages read per image page fault */
+    uint32_t fault_around_next; /* Next fault vaddr if faulting sequentially */
+    uint32_t rss;             /* Pages mapped, shared ones included */
+    uint32_t rss_quota;       /* Pages mapped before replacing its own */
+    uint32_t clock_hand;      /* Where its own replacement looks next */
+    uint32_t fault_rate;      /* Page faults in the last PFF interval */
+    uint32_t pff_fault_count; /* page_fault_count when the interval began */
+    uint64_t virtual_time;    /* CPU ticks run before the current dispatch */
+    uint64_t dispatch_time;   /* read_cpu_ticks() when last dispatched */
+    bool suspend_requested;   /* Load control wants it suspended */
+    bool suspended;           /* Swapped out by load control, not run */
 
 };
 
@@ -95,7 +112,7 @@ extern pcb_t pcb[PCB_TABLE_SIZE];
 void init_pcb_table(void);
 
 int create_thread(uintptr_t start_addr);
-int create_process(uint32_t location, uint32_t size);
+int create_process(uint32_t location, uint32_t size, uint32_t mem_size);
 
 /* === Dynamic Process Loading === */
 
@@ -103,11 +120,23 @@ int create_process(uint32_t location, uint32_t size);
 int readdir(unsigned char *buf);
 
 /* Load a process from the USB stick */
-int loadproc(int location, int size);
+int loadproc(int location, int size, int mem_size);
+
+/* Duplicate the running process, returns 0 in the child and -1 on failure */
+int fork(void);
 
 /* Remove pcb from its current queue and insert it into the free_pcb queue */
 void free_pcb(pcb_t *pcb);
 
+/*
+ * Hand an exited task, already off the ready queue, to the reaper thread.
+ * Called by the scheduler with interrupts disabled.
+ */
+void pcb_reap(pcb_t *pcb);
+
+/* Kernel thread freeing the memory and pcbs of exited tasks */
+void reaper_thread(void);
+
 void print_pcb_table(void);
 
 #endif /* THREAD_H */
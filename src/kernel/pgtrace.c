@@ -0,0 +1,90 @@
+/*
+ * Page fault and eviction trace.
+ *
+ * With PGTRACE set, every page fault and eviction is recorded in a ring
+ * buffer, which is drained to the second serial port from time to time.
+ * Bochs can write that port to a file for the pagesim simulator to replay
+ * (see pagesim.c), so that replacement policies and memory sizes can be
+ * compared offline. The format is in <syslib/pgtrace.h>.
+ *
+ * Records are added with interrupts disabled, from anywhere. When the
+ * ring is full new records are dropped and counted, and the count is
+ * written as a PGTRACE_LOST record once there is room again.
+ */
+
+#include "pgtrace.h"
+
+#include <stdbool.h>
+
+#include <util/util.h>
+
+#include "hardware/serial.h"
+#include "lib/printk.h"
+#include "sync.h"
+#include "time.h"
+
+#include "config.h"
+
+static struct pgtrace_record pgtrace_ring[PGTRACE_RING_RECORDS];
+static uint32_t              pgtrace_head, pgtrace_tail; /* in, out */
+static uint32_t              pgtrace_lost;
+static bool                  pgtrace_started;
+
+static bool pgtrace_full(void)
+{
+    return pgtrace_head - pgtrace_tail == PGTRACE_RING_RECORDS;
+}
+
+/* Add a record to the ring. Interrupts must be disabled. */
+static void pgtrace_put(uint32_t time, uint32_t page, uint32_t pid)
+{
+    struct pgtrace_record *rec = &pgtrace_ring[pgtrace_head % PGTRACE_RING_RECORDS];
+
+    rec->time = time;
+    rec->page = page;
+    rec->pid  = pid;
+    pgtrace_head++;
+}
+
+void pgtrace_record(enum pgtrace_event event, int pid, uint32_t vaddr)
+{
+    if (!PGTRACE) return;
+
+    uint32_t time = read_cpu_ticks() / cpu_mhz;
+
+    nointerrupt_enter();
+    if (!pgtrace_started) {
+        pgtrace_put(PGTRACE_MAGIC, PGTRACE_VERSION, 0);
+        pgtrace_started = true;
+    }
+    if (pgtrace_lost && PGTRACE_RING_RECORDS - (pgtrace_head - pgtrace_tail) >= 2) {
+        pgtrace_put(time, PGTRACE_PAGE(pgtrace_lost << 12, PGTRACE_LOST), 0);
+        pgtrace_lost = 0;
+    }
+    if (pgtrace_full()) {
+        pgtrace_lost++;
+    } else {
+        pgtrace_put(time, PGTRACE_PAGE(vaddr, event), pid);
+    }
+    nointerrupt_leave();
+}
+
+void pgtrace_flush(void)
+{
+    struct pgtrace_record rec;
+
+    if (!PGTRACE) return;
+
+    while (1) {
+        nointerrupt_enter();
+        if (pgtrace_tail == pgtrace_head) {
+            nointerrupt_leave();
+            return;
+        }
+        rec = pgtrace_ring[pgtrace_tail++ % PGTRACE_RING_RECORDS];
+        nointerrupt_leave();
+
+        // the serial port is slow, so one record at a time
+        serial_write(PORT_COM2, &rec, sizeof(rec));
+    }
+}
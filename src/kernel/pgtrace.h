@@ -0,0 +1,14 @@
+#ifndef PGTRACE_H
+#define PGTRACE_H
+
+#include <stdint.h>
+
+#include <syslib/pgtrace.h>
+
+/* Record a page event in the trace ring, if PGTRACE is set */
+void pgtrace_record(enum pgtrace_event event, int pid, uint32_t vaddr);
+
+/* Write the records in the ring to COM2, called by the reclaim thread */
+void pgtrace_flush(void);
+
+#endif /* !PGTRACE_H */
@@ -9,6 +9,7 @@
 #include "lib/assertk.h"
 #include "lib/printk.h"
 #include "lib/todo.h"
+#include "loadctl.h"
 #include "scheduler.h"
 #include "sync.h"
 #include "time.h"
@@ -33,6 +34,9 @@ void setup_current_running(void)
     if (!current_running->is_thread) { /* process */
         cpu_set_interrupt_stack(current_running->base_kernel_stack);
     }
+
+    /* Start charging CPU time to it, see scheduler() */
+    current_running->dispatch_time = read_cpu_ticks();
 }
 
 /*
@@ -53,6 +57,10 @@ void scheduler(void)
      */
     current_running->int_controller_mask = pic_get_mask();
 
+    /* Virtual time: the CPU time it has used, for WSClock replacement */
+    current_running->virtual_time +=
+            read_cpu_ticks() - current_running->dispatch_time;
+
     do {
         switch (current_running->status) {
 
@@ -77,14 +85,15 @@ void scheduler(void)
         case STATUS_EXITED: {
             struct pcb *outgoing = queue_shift(&current_running);
             assertf(current_running != NULL, "no more jobs");
-            free_pcb(outgoing);
+            pcb_reap(outgoing);
             break;
         }
 
         default: assertf(0, "Invalid job status."); break;
         }
-    } while (current_running->status != STATUS_READY
-             && current_running->status != STATUS_FIRST_TIME);
+    } while ((current_running->status != STATUS_READY
+              && current_running->status != STATUS_FIRST_TIME)
+             || current_running->suspended);
 
     /* .. and run it */
     dispatch();
@@ -118,6 +127,7 @@ void preempt(void)
 {
     nointerrupt_enter();
     current_running->preempt_count++;
+    loadctl_preempt();
     scheduler_entry();
     nointerrupt_leave();
 }
@@ -176,9 +186,8 @@ noreturn void exit(void)
         pr_debug("process exited \n");
         running_processes -= 1;
         pr_debug("current number of running processes %u \n", running_processes);
+        loadctl_wakeup();
     }
-    //     free_done_process_memory(current_running);
-    // }
 
     /* Removes job from ready queue, and dispatches next job to run */
     scheduler_entry();
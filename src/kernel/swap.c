@@ -0,0 +1,121 @@
+/*
+ * Swap area.
+ *
+ * createimage reserves a region at the end of the disk image and records
+ * it in the last entry of the process directory. The region is divided
+ * into page sized slots, tracked with a bitmap. Dirty pages are written to
+ * a slot when evicted, so process images on the stick are never modified
+ * and several processes can be started from the same image.
+ *
+ * A slot is referenced by every swapped page table entry and every frame
+ * holding a copy of it. After fork() parent and child refer to the same
+ * slots, which are counted so a slot is only reused when the last of them
+ * lets go.
+ *
+ * Evicted pages are kept compressed in memory by zswap.c for as long as
+ * there is room, and only then written to their slots.
+ */
+
+#define pr_fmt(fmt) "swap: " fmt
+
+#include "swap.h"
+
+#include <syslib/common.h>
+
+#include "lib/assertk.h"
+#include "lib/printk.h"
+#include "memory.h"
+#include "pcb.h"
+#include "sync.h"
+#include "zswap.h"
+
+static uint32_t   swap_loc;   /* first sector of the swap area */
+static uint32_t   swap_slots; /* number of usable slots */
+static uint32_t   swap_used;
+static uint32_t   swap_bitmap[SWAP_MAX_SLOTS / 32];
+static uint8_t    swap_refs[SWAP_MAX_SLOTS];
+static spinlock_t swap_lock = SPINLOCK_INIT;
+
+void swap_init(void)
+{
+    uint8_t             buf[SECTOR_SIZE];
+    struct directory_t *dir = (struct directory_t *) buf;
+
+    if (readdir(buf) < 0) {
+        pr_error("could not read process directory, swap disabled\n");
+        return;
+    }
+
+    struct directory_t *area = &dir[PROCESS_DIR_SWAP_SLOT];
+    if (area->location == 0) {
+        pr_error("image has no swap area, dirty pages cannot be evicted\n");
+        return;
+    }
+
+    swap_loc   = area->location;
+    swap_slots = area->size / SECTORS_PER_PAGE;
+    if (swap_slots > SWAP_MAX_SLOTS) swap_slots = SWAP_MAX_SLOTS;
+
+    pr_info("swap area at sector %u, %u slots\n", swap_loc, swap_slots);
+    zswap_init();
+}
+
+int swap_alloc(void)
+{
+    int slot = SWAP_NO_SLOT;
+
+    spinlock_acquire(&swap_lock);
+    for (uint32_t i = 0; i < swap_slots; i += 32) {
+        uint32_t word = swap_bitmap[i / 32];
+        if (word == 0xffffffff) continue;
+
+        uint32_t bit = __builtin_ctz(~word);
+        if (i + bit >= swap_slots) break;
+
+        swap_bitmap[i / 32] |= 1 << bit;
+        swap_refs[i + bit] = 1;
+        swap_used++;
+        slot = i + bit;
+        break;
+    }
+    spinlock_release(&swap_lock);
+
+    return slot;
+}
+
+void swap_free(int slot)
+{
+    assertk(0 <= slot && (uint32_t) slot < swap_slots);
+
+    spinlock_acquire(&swap_lock);
+    assertk(swap_bitmap[slot / 32] & (1 << (slot % 32)));
+    if (--swap_refs[slot] == 0) {
+        swap_bitmap[slot / 32] &= ~(1 << (slot % 32));
+        swap_used--;
+        // before anyone can get the slot and store to it again
+        zswap_invalidate(slot);
+    }
+    spinlock_release(&swap_lock);
+}
+
+void swap_dup(int slot)
+{
+    assertk(0 <= slot && (uint32_t) slot < swap_slots);
+
+    spinlock_acquire(&swap_lock);
+    assertk(swap_refs[slot] > 0 && swap_refs[slot] < UINT8_MAX);
+    swap_refs[slot]++;
+    spinlock_release(&swap_lock);
+}
+
+bool swap_shared(int slot)
+{
+    assertk(0 <= slot && (uint32_t) slot < swap_slots);
+    return swap_refs[slot] > 1;
+}
+
+uint32_t swap_slot_sector(int slot)
+{
+    assertk(0 <= slot && (uint32_t) slot < swap_slots);
+    return swap_loc + slot * SECTORS_PER_PAGE;
+}
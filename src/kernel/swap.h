@@ -0,0 +1,33 @@
+#ifndef SWAP_H
+#define SWAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum {
+    SWAP_NO_SLOT   = -1,   /* frame or PTE has no copy in swap */
+    SWAP_MAX_SLOTS = 4096, /* size of the slot bitmap (16 MB of swap) */
+};
+
+/*
+ * Read the swap area descriptor from the process directory. Must be called
+ * after the USB subsystem is up and before any page can be evicted.
+ */
+void swap_init(void);
+
+/* Allocate a page sized swap slot, returns SWAP_NO_SLOT if swap is full */
+int swap_alloc(void);
+
+/* Drop a reference to a slot, it is released with the last one */
+void swap_free(int slot);
+
+/* Add a reference to a slot, for another page table entry or frame */
+void swap_dup(int slot);
+
+/* Whether more than one page table entry or frame refers to 'slot' */
+bool swap_shared(int slot);
+
+/* First sector on the USB stick holding the page stored in 'slot' */
+uint32_t swap_slot_sector(int slot);
+
+#endif /* !SWAP_H */
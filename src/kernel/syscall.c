@@ -55,6 +55,7 @@ static void init_syscall_jumptable(void)
     add_to_table(SYSCALL_GETCHAR, (syscall_t) getchar);
     add_to_table(SYSCALL_READDIR, (syscall_t) readdir);
     add_to_table(SYSCALL_LOADPROC, (syscall_t) loadproc);
+    add_to_table(SYSCALL_FORK, (syscall_t) fork);
 
 #pragma GCC diagnostic pop
 
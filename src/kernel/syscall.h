@@ -8,4 +8,18 @@ void init_syscalls(void);
 
 void syscall_entry_interrupt(void); // Defined in assembly
 
+/*
+ * Bytes syscall_entry_interrupt() keeps on the kernel stack of a process
+ * making a syscall: the interrupt frame, the frame pointer and return value,
+ * and the general, floating point and data segment registers. They sit
+ * right below the base of the kernel stack.
+ */
+enum { SYSCALL_FRAME_SIZE = 5 * 4 + 2 * 4 + 7 * 4 + 108 + 2 * 4 };
+
+/*
+ * Where a process created by fork() starts, on a copy of its parent's
+ * syscall frame. Returns to user mode with 0 as the result of the syscall.
+ */
+void fork_child_entry(void); // Defined in assembly
+
 #endif /* SYSCALL_H */
@@ -9,6 +9,7 @@
 #include "th1.h"
 #include "mbox.h"
 #include "sleep.h"
+#include "swap.h"
 #include "time.h"
 #include "usb/scsi.h"
 #include "usb/usb_hub.h"
@@ -25,11 +26,14 @@ void loader_thread(void)
     /* Wait until USB subsystem has been initialized */
     while (!scsi_up()) yield();
 
+    /* find the swap area before anything can be paged out */
+    swap_init();
+
     /* read process directory sector into buf */
     readdir(buf);
     /* only load the first process, we assume it's the shell */
     if (dir->location != 0) {
-        loadproc(dir->location, dir->size);
+        loadproc(dir->location, dir->size, dir->mem_size);
     }
     exit();
 }
@@ -0,0 +1,272 @@
+/*
+ * Compressed swap cache.
+ *
+ * Writing a page to the USB stick is slow, and so is reading it back. Dirty
+ * pages are instead compressed into a pool of pinned frames when evicted,
+ * and a fault on them decompresses them from there. Only when the pool is
+ * full are the pages that have been in it the longest written to their
+ * swap slots, to make room.
+ *
+ * A page in the pool still has a swap slot, allocated as usual when it was
+ * evicted, and the pool is looked up by slot number. The page table entries
+ * and frames referring to the slot don't know where its contents are. A
+ * compressed page takes a run of chunks within a single pool frame.
+ *
+ * The pool is only changed with interrupts disabled, so that slots can be
+ * invalidated from anywhere. zswap_lock serializes the stores, which use
+ * the compressor and the two buffer pages while interrupts are enabled.
+ */
+
+#define pr_fmt(fmt) "zswap: " fmt
+
+#include "zswap.h"
+
+#include <string.h>
+
+#include <syslib/common.h>
+#include <util/lz.h>
+
+#include "lib/assertk.h"
+#include "lib/printk.h"
+#include "memory.h"
+#include "swap.h"
+#include "sync.h"
+#include "usb/scsi.h"
+
+#include "config.h"
+
+enum {
+    CHUNKS_PER_PAGE = PAGE_SIZE / ZSWAP_CHUNK_SIZE,
+};
+
+_Static_assert(CHUNKS_PER_PAGE <= 32, "chunk bitmap of a pool frame is 32 bits");
+_Static_assert(ZSWAP_MAX_SIZE <= PAGE_SIZE, "compressed pages fit in a frame");
+
+struct zswap_entry {
+    int16_t  slot;      /* SWAP_NO_SLOT if the entry is unused */
+    uint16_t size;      /* compressed size in bytes */
+    uint8_t  frame;     /* pool frame holding it */
+    uint8_t  chunk;     /* first chunk in the frame */
+    bool     writeback; /* being written to its slot */
+    uint32_t age;       /* store count when stored, oldest is written first */
+};
+
+static bool               zswap_enabled;
+static uint8_t           *zswap_pool[ZSWAP_POOL_PAGES];
+static uint32_t           zswap_chunk_map[ZSWAP_POOL_PAGES]; /* used chunks */
+static struct zswap_entry zswap_entry[ZSWAP_MAX_ENTRIES];
+
+static lock_t          zswap_lock = LOCK_INIT;
+static struct lz_state zswap_lz;
+static uint8_t        *zswap_buf;     /* compressor output */
+static uint32_t       *zswap_wb_page; /* page being written back */
+
+static struct {
+    uint32_t stores;     /* pages offered */
+    uint32_t rejects;    /* did not compress well enough */
+    uint32_t writebacks; /* written to swap to make room */
+    uint32_t hits, misses;
+    uint32_t bytes_in, bytes_out; /* of the pages stored */
+} zswap_stats;
+
+void zswap_init(void)
+{
+    if (ZSWAP_POOL_PAGES == 0) return;
+
+    for (int i = 0; i < ZSWAP_MAX_ENTRIES; i++) zswap_entry[i].slot = SWAP_NO_SLOT;
+    for (int i = 0; i < ZSWAP_POOL_PAGES; i++) {
+        zswap_pool[i] = (uint8_t *) allocate_kernel_page();
+    }
+    zswap_buf     = (uint8_t *) allocate_kernel_page();
+    zswap_wb_page = allocate_kernel_page();
+    zswap_enabled = true;
+
+    pr_info("%u pages of compressed swap cache\n", ZSWAP_POOL_PAGES);
+}
+
+/* Entry holding 'slot', or -1. Interrupts must be disabled. */
+static int zswap_find(int slot)
+{
+    for (int i = 0; i < ZSWAP_MAX_ENTRIES; i++) {
+        if (zswap_entry[i].slot == slot) return i;
+    }
+    return -1;
+}
+
+static uint32_t chunk_mask(struct zswap_entry *e)
+{
+    uint32_t n = (e->size + ZSWAP_CHUNK_SIZE - 1) / ZSWAP_CHUNK_SIZE;
+    return (n == 32 ? ~0u : (1u << n) - 1) << e->chunk;
+}
+
+/* Free entry 'i' and its chunks. Interrupts must be disabled. */
+static void zswap_drop(int i)
+{
+    struct zswap_entry *e = &zswap_entry[i];
+
+    zswap_chunk_map[e->frame] &= ~chunk_mask(e);
+    e->slot      = SWAP_NO_SLOT;
+    e->writeback = false;
+}
+
+static uint8_t *zswap_data(struct zswap_entry *e)
+{
+    return zswap_pool[e->frame] + e->chunk * ZSWAP_CHUNK_SIZE;
+}
+
+/*
+ * Copy the 'size' bytes in zswap_buf into the pool for 'slot'. Returns
+ * false if there is no free entry or run of chunks long enough.
+ */
+static bool zswap_place(int slot, int size)
+{
+    uint32_t n    = (size + ZSWAP_CHUNK_SIZE - 1) / ZSWAP_CHUNK_SIZE;
+    uint32_t mask = n == 32 ? ~0u : (1u << n) - 1;
+    bool     done = false;
+
+    nointerrupt_enter();
+    int i = zswap_find(SWAP_NO_SLOT);
+    for (int f = 0; i >= 0 && !done && f < ZSWAP_POOL_PAGES; f++) {
+        for (uint32_t c = 0; c + n <= CHUNKS_PER_PAGE; c++) {
+            if (zswap_chunk_map[f] & (mask << c)) continue;
+
+            struct zswap_entry *e = &zswap_entry[i];
+            e->slot   = slot;
+            e->size   = size;
+            e->frame  = f;
+            e->chunk  = c;
+            e->age    = zswap_stats.stores;
+            zswap_chunk_map[f] |= mask << c;
+            memcpy(zswap_data(e), zswap_buf, size);
+            done = true;
+            break;
+        }
+    }
+    nointerrupt_leave();
+    return done;
+}
+
+/*
+ * Write the oldest page in the pool to its swap slot and free its space.
+ * Returns false if there is nothing to write back. Called with zswap_lock
+ * held.
+ */
+static bool zswap_writeback_oldest(void)
+{
+    int oldest = -1, slot;
+
+    nointerrupt_enter();
+    for (int i = 0; i < ZSWAP_MAX_ENTRIES; i++) {
+        struct zswap_entry *e = &zswap_entry[i];
+        if (e->slot == SWAP_NO_SLOT) continue;
+        if (oldest < 0 || e->age < zswap_entry[oldest].age) oldest = i;
+    }
+    if (oldest < 0) {
+        nointerrupt_leave();
+        return false;
+    }
+    struct zswap_entry *e = &zswap_entry[oldest];
+    e->writeback = true;
+    slot         = e->slot;
+    int size = lz_decompress(zswap_data(e), e->size, zswap_wb_page, PAGE_SIZE);
+    assertk(size == PAGE_SIZE);
+    nointerrupt_leave();
+
+    // the page can still be loaded from the pool while it is written
+    int success = scsi_write(swap_slot_sector(slot), SECTORS_PER_PAGE, (char *) zswap_wb_page);
+
+    nointerrupt_enter();
+    // the slot may have been freed in the meantime, taking the entry
+    if (e->writeback) {
+        if (success >= 0) {
+            zswap_drop(oldest);
+            zswap_stats.writebacks++;
+        } else {
+            e->writeback = false;
+        }
+    }
+    nointerrupt_leave();
+
+    if (success < 0) pr_error("failed to write back swap slot %d\n", slot);
+    return success >= 0;
+}
+
+static void zswap_log_stats(void)
+{
+    uint32_t used = 0;
+    for (int i = 0; i < ZSWAP_MAX_ENTRIES; i++) {
+        if (zswap_entry[i].slot != SWAP_NO_SLOT) used++;
+    }
+
+    pr_log("%u pages stored at %u%% of their size, %u did not compress, "
+           "%u written back, %u in the pool\n",
+           zswap_stats.bytes_in / PAGE_SIZE,
+           zswap_stats.bytes_in ? zswap_stats.bytes_out / (zswap_stats.bytes_in / 100) : 0,
+           zswap_stats.rejects, zswap_stats.writebacks, used);
+    pr_log("%u of %u loads found in the pool\n", zswap_stats.hits,
+           zswap_stats.hits + zswap_stats.misses);
+}
+
+bool zswap_store(int slot, const uint32_t *page)
+{
+    bool stored = false;
+
+    if (!zswap_enabled) return false;
+
+    lock_acquire(&zswap_lock);
+    int size = lz_compress(&zswap_lz, page, PAGE_SIZE, zswap_buf, ZSWAP_MAX_SIZE);
+
+    nointerrupt_enter();
+    // what the pool has for the slot is an older version of the page
+    int old = zswap_find(slot);
+    if (old >= 0) zswap_drop(old);
+    zswap_stats.stores++;
+    if (size < 0) zswap_stats.rejects++;
+    nointerrupt_leave();
+
+    if (size >= 0) {
+        while (!(stored = zswap_place(slot, size)) && zswap_writeback_oldest()) {
+        }
+    }
+    if (stored) {
+        nointerrupt_enter();
+        zswap_stats.bytes_in  += PAGE_SIZE;
+        zswap_stats.bytes_out += size;
+        nointerrupt_leave();
+    }
+    if (zswap_stats.stores % ZSWAP_STATS_INTERVAL == 0) zswap_log_stats();
+    lock_release(&zswap_lock);
+
+    pr_debug("slot %d %s (%d bytes)\n", slot, stored ? "stored" : "not stored", size);
+    return stored;
+}
+
+bool zswap_load(int slot, uint32_t *page)
+{
+    if (!zswap_enabled) return false;
+
+    nointerrupt_enter();
+    int i = zswap_find(slot);
+    if (i < 0) {
+        zswap_stats.misses++;
+        nointerrupt_leave();
+        return false;
+    }
+
+    struct zswap_entry *e = &zswap_entry[i];
+    int size = lz_decompress(zswap_data(e), e->size, page, PAGE_SIZE);
+    assertk(size == PAGE_SIZE);
+    zswap_stats.hits++;
+    nointerrupt_leave();
+    return true;
+}
+
+void zswap_invalidate(int slot)
+{
+    if (!zswap_enabled) return;
+
+    nointerrupt_enter();
+    int i = zswap_find(slot);
+    if (i >= 0) zswap_drop(i);
+    nointerrupt_leave();
+}
@@ -0,0 +1,23 @@
+#ifndef ZSWAP_H
+#define ZSWAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Allocate the compressed pool, called by swap_init() */
+void zswap_init(void);
+
+/*
+ * Compress the page at 'page', on its way to swap slot 'slot', into the
+ * pool. Returns false if it has to be written to the slot instead. Can
+ * write older pages in the pool to swap to make room.
+ */
+bool zswap_store(int slot, const uint32_t *page);
+
+/* Decompress the page of 'slot' into 'page', false if it isn't in the pool */
+bool zswap_load(int slot, uint32_t *page);
+
+/* Forget what the pool has for 'slot', which is being freed */
+void zswap_invalidate(int slot);
+
+#endif /* !ZSWAP_H */
@@ -19,30 +19,38 @@
 /* Where to load the kernel */
 #define KERNEL_PADDR 0x8000
 
+/*
+ * BIOS E820 memory map collected by the bootblock: a 32-bit entry count
+ * followed by up to MEMORY_MAP_MAX_ENTRIES entries of 24 bytes.
+ */
+#define MEMORY_MAP_PADDR        0x1000
+#define MEMORY_MAP_ENTRY_OFFSET 4
+#define MEMORY_MAP_MAX_ENTRIES  32
+
 /* Working stack for the bootblock and for kernel initialization */
 #define STACK_PADDR 0x80000
 
-/* Physical area reserved for allocatinge kernel-level stacks for threads */
-#define T_KSTACK_AREA_MIN_PADDR 0x40000
-#define T_KSTACK_AREA_MAX_PADDR 0x80000
+/* Kernel-level stacks of threads and processes, allocated from paging area */
 #define T_KSTACK_SIZE_EACH      0x2000
 #define T_KSTACK_START_OFFSET   0x1ffc
 
 /*
  * Physical memory area used for allocating virtual memory pages
  *
+ * The area starts at 1MB and covers the usable RAM in the memory map the
+ * bootblock collects. It is identity mapped, so it has to end below
+ * process space.
+ *
  * From this simple operating system's perspective, modern PCs basically have
- * unlimited memory, so we have to artificially limit the amount of memory
- * available if we want to see swapping in action.
+ * unlimited memory, so limit the number of pageable pages (to e.g. 33) if
+ * you want to see swapping in action. 0 means no limit.
  */
 #define PAGE_SIZE 0x1000 // aka 4096 aka 4 KiB
-#define PAGEABLE_PAGES 33
+#define PAGEABLE_PAGES_LIMIT 0
 
-// #define PAGEABLE_PAGES 29
-// #define PAGEABLE_PAGES        500
+// #define PAGEABLE_PAGES_LIMIT 33
 #define PAGING_AREA_MIN_PADDR 0x100000 /* 1MB */
-#define PAGING_AREA_MAX_PADDR \
-    (PAGING_AREA_MIN_PADDR + PAGE_SIZE * PAGEABLE_PAGES)
+#define PAGING_AREA_MAX_PADDR PROCESS_VADDR
 
 /* === OS-defined virtual addresses === */
 
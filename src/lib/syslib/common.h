@@ -46,6 +46,7 @@ enum {
     SYSCALL_GETCHAR,
     SYSCALL_READDIR,
     SYSCALL_LOADPROC,
+    SYSCALL_FORK,
     SYSCALL_COUNT
 };
 
@@ -93,6 +94,17 @@ typedef struct msg msg_t;
 struct directory_t {
     int location; /* Sector number */
     int size;     /* Size in number of sectors */
+    int mem_size; /* Sectors in memory, the rest past 'size' is zero-filled */
 };
 
+/*
+ * The directory is one sector long, and the last entry is not a process.
+ * It describes the swap area that createimage reserves at the end of the
+ * image (location 0 if there is none). Process entries are terminated by
+ * an entry with location 0, so programs that list the directory never
+ * reach it.
+ */
+#define PROCESS_DIR_ENTRIES   (SECTOR_SIZE / sizeof(struct directory_t))
+#define PROCESS_DIR_SWAP_SLOT (PROCESS_DIR_ENTRIES - 1)
+
 #endif /* !COMMON_H */
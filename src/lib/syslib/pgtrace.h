@@ -0,0 +1,46 @@
+/*
+ * Binary page trace format, written by the kernel over COM2 (see
+ * kernel/pgtrace.c) and read by the pagesim simulator on the host.
+ *
+ * The trace is a stream of 12-byte little-endian records. The first one is
+ * a header with PGTRACE_MAGIC in 'time' and PGTRACE_VERSION in 'page'.
+ * Every other record has the time in microsecs since boot, the pid of the
+ * process, and packs the page address and event type into 'page':
+ *
+ *      bits 31..12     virtual page address
+ *      bits 11..4      zero
+ *      bits 3..0       event (PGTRACE_*)
+ *
+ * The pid has a word of its own, as pids are not reused and a trace
+ * outlives any field narrow enough to share 'page'.
+ *
+ * A PGTRACE_LOST record has the number of records dropped when the ring
+ * buffer in the kernel overflowed in place of the page address.
+ */
+#ifndef PGTRACE_FORMAT_H
+#define PGTRACE_FORMAT_H
+
+#include <stdint.h>
+
+#define PGTRACE_MAGIC   0x54475000 /* "\0PGT" */
+#define PGTRACE_VERSION 2
+
+enum pgtrace_event {
+    PGTRACE_READ        = 1, /* page fault on a read */
+    PGTRACE_WRITE       = 2, /* page fault on a write */
+    PGTRACE_EVICT       = 3, /* clean page evicted */
+    PGTRACE_EVICT_DIRTY = 4, /* dirty page evicted, written to swap */
+    PGTRACE_LOST        = 5, /* records dropped */
+};
+
+struct pgtrace_record {
+    uint32_t time;
+    uint32_t page;
+    uint32_t pid;
+};
+
+#define PGTRACE_PAGE(vaddr, event) (((vaddr) & 0xfffff000) | ((event) & 0xf))
+#define PGTRACE_VADDR(page)         ((page) & 0xfffff000)
+#define PGTRACE_EVENT(page)         ((page) & 0xf)
+
+#endif /* !PGTRACE_FORMAT_H */
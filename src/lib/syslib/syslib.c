@@ -113,8 +113,10 @@ int readdir(unsigned char *buf)
     return invoke_syscall1(SYSCALL_READDIR, buf);
 }
 
-int loadproc(int location, int size)
+int loadproc(int location, int size, int mem_size)
 {
-    return invoke_syscall2(SYSCALL_LOADPROC, location, size);
+    return invoke_syscall3(SYSCALL_LOADPROC, location, size, mem_size);
 }
 
+int fork(void) { return invoke_syscall0(SYSCALL_FORK); }
+
@@ -22,6 +22,7 @@ int mbox_send(int q, msg_t *m);
 int getchar(int *c);
 
 int readdir(unsigned char *buf);
-int loadproc(int location, int size);
+int loadproc(int location, int size, int mem_size);
+int fork(void);
 
 #endif /* !SYSLIB_H */
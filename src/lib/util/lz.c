@@ -0,0 +1,140 @@
+/*
+ * LZ77 page compressor, see lz.h for the format.
+ */
+
+#include "lz.h"
+
+#include <stddef.h>
+
+static uint32_t read32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write the rest of a count that did not fit in its nibble */
+static uint8_t *put_count(uint8_t *op, const uint8_t *oend, uint32_t n)
+{
+    for (n -= 15; n >= 255; n -= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = n;
+    return op;
+}
+
+/* Read the rest of a count whose nibble was 15, -1 if truncated */
+static int get_count(const uint8_t **ip, const uint8_t *iend)
+{
+    int n = 0;
+    uint8_t b;
+
+    do {
+        if (*ip >= iend) return -1;
+        b  = *(*ip)++;
+        n += b;
+    } while (b == 255);
+    return n;
+}
+
+/*
+ * Write one sequence: 'nlit' literals from 'lit', then a match of 'mlen'
+ * bytes 'offset' back. A sequence with 'mlen' 0 ends the data.
+ */
+static uint8_t *put_sequence(
+        uint8_t *op, const uint8_t *oend, const uint8_t *lit, uint32_t nlit,
+        uint32_t offset, uint32_t mlen
+)
+{
+    uint32_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+    uint8_t *token = op;
+
+    if (op >= oend) return NULL;
+    op++;
+    *token = (nlit < 15 ? nlit : 15) << 4 | (mcode < 15 ? mcode : 15);
+
+    if (nlit >= 15 && !(op = put_count(op, oend, nlit))) return NULL;
+    if ((uint32_t) (oend - op) < nlit) return NULL;
+    for (uint32_t i = 0; i < nlit; i++) *op++ = lit[i];
+
+    if (!mlen) return op;
+    if (oend - op < 2) return NULL;
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (mcode >= 15 && !(op = put_count(op, oend, mcode))) return NULL;
+    return op;
+}
+
+int lz_compress(struct lz_state *s, const void *src, int len, void *dst, int cap)
+{
+    const uint8_t *in = src, *ip = in, *anchor = in, *end = in + len;
+    uint8_t       *op = dst, *oend = op + cap;
+
+    if (len < 0 || len > LZ_MAX_INPUT) return -1;
+
+    // positions are stored plus one, so that zero means empty
+    for (int i = 0; i < LZ_HASH_SIZE; i++) s->table[i] = 0;
+
+    while (end - ip >= LZ_MIN_MATCH) {
+        uint32_t h    = hash32(read32(ip));
+        uint16_t seen = s->table[h];
+
+        s->table[h] = ip - in + 1;
+        if (!seen || read32(in + seen - 1) != read32(ip)) {
+            ip++;
+            continue;
+        }
+
+        const uint8_t *ref  = in + seen - 1;
+        uint32_t       mlen = LZ_MIN_MATCH;
+        while (ip + mlen < end && ref[mlen] == ip[mlen]) mlen++;
+
+        op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, mlen);
+        if (!op) return -1;
+        ip    += mlen;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+    if (!op) return -1;
+    return op - (uint8_t *) dst;
+}
+
+int lz_decompress(const void *src, int len, void *dst, int cap)
+{
+    const uint8_t *ip = src, *iend = ip + len;
+    uint8_t       *out = dst, *op = out, *oend = out + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        int     nlit  = token >> 4, mlen = token & 15, offset, extra;
+
+        if (nlit == 15) {
+            if ((extra = get_count(&ip, iend)) < 0) return -1;
+            nlit += extra;
+        }
+        if (nlit > iend - ip || nlit > oend - op) return -1;
+        for (int i = 0; i < nlit; i++) *op++ = *ip++;
+
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip    += 2;
+        if (mlen == 15) {
+            if ((extra = get_count(&ip, iend)) < 0) return -1;
+            mlen += extra;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op - out || mlen > oend - op) return -1;
+
+        // byte by byte, the match may overlap what it produces
+        for (const uint8_t *ref = op - offset; mlen > 0; mlen--) *op++ = *ref++;
+    }
+    return op - out;
+}
@@ -0,0 +1,49 @@
+/*
+ * A small LZ77 compressor in the style of LZ4, meant for compressing
+ * single pages. It is fast rather than thorough: matches are found through
+ * a hash table of the last position each 4-byte sequence was seen at.
+ *
+ * The compressed data is a series of sequences, each a token byte followed
+ * by literal bytes and a match to copy from earlier output:
+ *
+ *      token      high nibble: literal count, low nibble: match length - 4
+ *      [extra]    literal count continued if the nibble is 15
+ *      literals
+ *      offset     2 bytes, little endian, distance back to copy from
+ *      [extra]    match length continued if the nibble is 15
+ *
+ * A count continues with bytes that are added to it for as long as they are
+ * 255. The last sequence has literals only and no offset.
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+enum {
+    LZ_MIN_MATCH = 4,       /* shortest match worth encoding */
+    LZ_MAX_INPUT = 0xffff,  /* positions are kept in 16 bits */
+    LZ_HASH_BITS = 10,
+    LZ_HASH_SIZE = 1 << LZ_HASH_BITS,
+};
+
+/* Scratch space for the compressor, can be reused between calls */
+struct lz_state {
+    uint16_t table[LZ_HASH_SIZE];
+};
+
+/*
+ * Compress 'len' bytes at 'src' into at most 'cap' bytes at 'dst'.
+ * Returns the compressed size, or -1 if it would not fit in 'cap' bytes.
+ */
+int lz_compress(struct lz_state *s, const void *src, int len, void *dst, int cap);
+
+/*
+ * Decompress 'len' bytes at 'src' into at most 'cap' bytes at 'dst'.
+ * Returns the decompressed size, or -1 if the data is malformed or would
+ * not fit.
+ */
+int lz_decompress(const void *src, int len, void *dst, int cap);
+
+#endif /* !LZ_H */
@@ -0,0 +1,104 @@
+#include "lz.h"
+
+#include <string.h>
+
+#include <unittest/unittest.h>
+
+enum { PAGE = 4096 };
+
+static struct lz_state state;
+static uint8_t         page[PAGE], packed[2 * PAGE], unpacked[PAGE];
+
+/* Compress and decompress 'len' bytes of 'page', return compressed size */
+static int roundtrip(int len)
+{
+    int size = lz_compress(&state, page, len, packed, sizeof(packed));
+    if (size < 0) return -1;
+    if (lz_decompress(packed, size, unpacked, sizeof(unpacked)) != len) return -1;
+    if (memcmp(page, unpacked, len) != 0) return -1;
+    return size;
+}
+
+int test_lz_zero_page()
+{
+    memset(page, 0, PAGE);
+
+    int size = roundtrip(PAGE);
+    tassert_gt(size, 0);
+    tassert_lt(size, 32);
+
+    return TEST_PASS;
+}
+
+int test_lz_text()
+{
+    const char *line = "mbox_send: message queued for process 3\n";
+    int         n    = strlen(line);
+
+    for (int i = 0; i < PAGE; i++) page[i] = line[i % n];
+
+    int size = roundtrip(PAGE);
+    tassert_gt(size, 0);
+    tassert_lt(size, PAGE / 8);
+
+    return TEST_PASS;
+}
+
+int test_lz_incompressible()
+{
+    uint32_t x = 12345;
+
+    for (int i = 0; i < PAGE; i++) {
+        x       = x * 1103515245 + 12345;
+        page[i] = x >> 24;
+    }
+
+    /* grows a little, but must still come back intact */
+    int size = roundtrip(PAGE);
+    tassert_gt(size, PAGE - 1);
+
+    /* and does not fit if there is no room for it */
+    tassert_eq(-1, lz_compress(&state, page, PAGE, packed, PAGE / 2));
+
+    return TEST_PASS;
+}
+
+int test_lz_short_inputs()
+{
+    memcpy(page, "abcdabcdabcd", 12);
+
+    for (int len = 0; len <= 12; len++) {
+        tassert_gt(roundtrip(len), 0);
+    }
+
+    return TEST_PASS;
+}
+
+int test_lz_long_literals()
+{
+    /* a literal run longer than 255 + 15, then a long match */
+    for (int i = 0; i < 300; i++) page[i] = i * 7 + (i >> 8);
+    memset(page + 300, 'x', 1000);
+
+    tassert_gt(roundtrip(1300), 0);
+
+    return TEST_PASS;
+}
+
+int test_lz_malformed()
+{
+    /* one literal, then a match reaching back before the start */
+    uint8_t bad_offset[] = {0x10, 'a', 0x02, 0x00};
+    tassert_eq(-1, lz_decompress(bad_offset, sizeof(bad_offset), unpacked, PAGE));
+
+    /* a literal count promising more bytes than there are */
+    uint8_t truncated[] = {0x50, 'a', 'b'};
+    tassert_eq(-1, lz_decompress(truncated, sizeof(truncated), unpacked, PAGE));
+
+    /* output that does not fit */
+    memset(page, 0, PAGE);
+    int size = lz_compress(&state, page, PAGE, packed, sizeof(packed));
+    tassert_eq(-1, lz_decompress(packed, size, unpacked, PAGE / 2));
+
+    return TEST_PASS;
+}
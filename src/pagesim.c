@@ -0,0 +1,426 @@
+/*
+ * Offline page replacement simulator.
+ *
+ * Replays a page trace recorded by the kernel with PGTRACE set (see
+ * kernel/pgtrace.c) against FIFO, Random, Clock, LRU and Belady's optimal
+ * replacement, for a range of frame counts, and reports the fault rate and
+ * the disk traffic of each.
+ *
+ * The references replayed are the page faults in the trace. Pages that
+ * stayed resident in the kernel were referenced in between without
+ * faulting, so the trace is only a faithful reference string for memories
+ * no larger than the one it was recorded with. Record with a large
+ * PAGEABLE_PAGES_LIMIT to simulate small ones.
+ *
+ * Every fault counts as a page read, and every eviction of a page written
+ * to since it was read as a page write.
+ */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <syslib/compiler_compat.h>
+#include <syslib/pgtrace.h>
+
+static const char *usage_args[] = {
+        "[--frames=<n>[,<n>...]]",
+        "[--pid=<pid>]",
+        "<trace>",
+};
+
+#define PAGE_KB    4
+#define MAX_RUNS   32
+#define NO_PAGE    (-1)
+#define NEVER      UINT32_MAX
+
+/* structure to store command line options */
+static struct {
+    const char *progname;
+    const char *trace;
+    int         pid; /* only replay this process, -1 for all */
+    size_t      frame_runs;
+    uint32_t    frames[MAX_RUNS];
+} options;
+
+enum policy {
+    POLICY_FIFO,
+    POLICY_RANDOM,
+    POLICY_CLOCK,
+    POLICY_LRU,
+    POLICY_OPT,
+    POLICY_COUNT,
+};
+
+static const char *policy_names[POLICY_COUNT] = {
+        "FIFO", "Random", "Clock", "LRU", "OPT",
+};
+
+/* The reference string, with pages numbered densely from 0 */
+static struct {
+    uint32_t *page;     /* page of each reference */
+    bool     *write;    /* whether it was a write */
+    uint32_t *next_use; /* index of the next reference to the page, or NEVER */
+    uint32_t  count;
+    uint32_t  pages;    /* distinct pages */
+} refs;
+
+/* What the kernel itself did, from the trace */
+static struct {
+    uint32_t records, reads, writes, evictions, dirty_evictions, lost;
+    uint32_t first_time, last_time;
+} trace_stats;
+
+/* Results of one simulation */
+struct sim_result {
+    uint32_t faults, writes;
+};
+
+/* prototypes of local functions */
+static void read_trace(FILE *fp, const char *filename);
+static void compute_next_use(void);
+static struct sim_result simulate(enum policy policy, uint32_t nframes);
+static void report(void);
+
+ATTR_PRINTFLIKE(1, 2) static void error(const char *fmt, ...);
+ATTR_PRINTFLIKE(1, 2) static void usage_error(const char *fmt, ...);
+
+int main(int argc, const char **argv)
+{
+    /* process command line options */
+    options.progname = argv[0];
+    options.pid      = -1;
+
+    int i = 1;
+
+    /* first, check for flags (args that begin with "--") */
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+
+        if (strncmp(argv[i], "--frames=", 9) == 0) {
+            const char *p = argv[i] + 9;
+            char       *end;
+            do {
+                if (options.frame_runs == MAX_RUNS) {
+                    usage_error("at most %d frame counts\n", MAX_RUNS);
+                }
+                unsigned long n = strtoul(p, &end, 0);
+                if (end == p || n == 0 || (*end != ',' && *end != '\0')) {
+                    usage_error("invalid frame count list '%s'\n", argv[i] + 9);
+                }
+                options.frames[options.frame_runs++] = n;
+                p = end + 1;
+            } while (*end == ',');
+
+        } else if (strncmp(argv[i], "--pid=", 6) == 0) {
+            char *end;
+            options.pid = strtol(argv[i] + 6, &end, 0);
+            if (*end != '\0' || options.pid < 0) {
+                usage_error("invalid pid '%s'\n", argv[i] + 6);
+            }
+
+        } else {
+            usage_error("unknown option '%s'\n", argv[i]);
+        }
+    }
+
+    /* the trace file is the only argument */
+    if (i >= argc) usage_error("missing trace file\n");
+    if (i + 1 < argc) usage_error("too many arguments\n");
+    options.trace = argv[i];
+
+    FILE *fp = fopen(options.trace, "rb");
+    if (!fp) error("could not open trace '%s'\n", options.trace);
+    read_trace(fp, options.trace);
+    fclose(fp);
+    if (refs.count == 0) error("no page faults in '%s'\n", options.trace);
+    compute_next_use();
+
+    /* by default, powers of two up to where everything fits */
+    if (options.frame_runs == 0) {
+        for (uint32_t n = 8; options.frame_runs < MAX_RUNS; n *= 2) {
+            options.frames[options.frame_runs++] = n;
+            if (n >= refs.pages) break;
+        }
+    }
+
+    report();
+    return 0;
+}
+
+/* === Reading the trace === */
+
+/* Open addressing hash table from (pid, page address) keys to page numbers */
+static struct {
+    uint64_t *key; /* key + 1, 0 if the slot is empty */
+    uint32_t *page;
+    uint32_t  size;
+} page_table;
+
+static uint32_t page_hash(uint64_t key)
+{
+    return (uint32_t) (key ^ key >> 32) * 2654435761u & (page_table.size - 1);
+}
+
+static void page_table_grow(void)
+{
+    uint32_t  old_size = page_table.size;
+    uint64_t *old_key  = page_table.key;
+    uint32_t *old_page = page_table.page;
+
+    page_table.size = old_size ? old_size * 2 : 1024;
+    page_table.key  = calloc(page_table.size, sizeof(uint64_t));
+    page_table.page = calloc(page_table.size, sizeof(uint32_t));
+    if (!page_table.key || !page_table.page) error("out of memory\n");
+
+    for (uint32_t i = 0; i < old_size; i++) {
+        if (!old_key[i]) continue;
+        uint32_t h = page_hash(old_key[i]);
+        while (page_table.key[h]) h = (h + 1) & (page_table.size - 1);
+        page_table.key[h]  = old_key[i];
+        page_table.page[h] = old_page[i];
+    }
+    free(old_key);
+    free(old_page);
+}
+
+/* Number of the page with 'key', numbering it if it is new */
+static uint32_t page_number(uint64_t key)
+{
+    if (refs.pages * 2 >= page_table.size) page_table_grow();
+
+    key++;
+    uint32_t h = page_hash(key);
+    while (page_table.key[h] && page_table.key[h] != key) {
+        h = (h + 1) & (page_table.size - 1);
+    }
+    if (!page_table.key[h]) {
+        page_table.key[h]  = key;
+        page_table.page[h] = refs.pages++;
+    }
+    return page_table.page[h];
+}
+
+static void add_reference(uint32_t page, bool write)
+{
+    static uint32_t capacity;
+
+    if (refs.count == capacity) {
+        capacity   = capacity ? capacity * 2 : 4096;
+        refs.page  = realloc(refs.page, capacity * sizeof(*refs.page));
+        refs.write = realloc(refs.write, capacity * sizeof(*refs.write));
+        if (!refs.page || !refs.write) error("out of memory\n");
+    }
+    refs.page[refs.count]  = page;
+    refs.write[refs.count] = write;
+    refs.count++;
+}
+
+static void read_trace(FILE *fp, const char *filename)
+{
+    struct pgtrace_record rec;
+
+    if (fread(&rec, sizeof(rec), 1, fp) != 1 || rec.time != PGTRACE_MAGIC) {
+        error("'%s' is not a page trace\n", filename);
+    }
+    if (rec.page != PGTRACE_VERSION) {
+        error("'%s' is trace version %u, expected %u\n", filename, rec.page,
+              PGTRACE_VERSION);
+    }
+
+    while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+        enum pgtrace_event event = PGTRACE_EVENT(rec.page);
+        uint32_t           pid   = rec.pid;
+
+        if (!trace_stats.records++) trace_stats.first_time = rec.time;
+        trace_stats.last_time = rec.time;
+
+        if (event == PGTRACE_LOST) {
+            trace_stats.lost += PGTRACE_VADDR(rec.page) >> 12;
+            continue;
+        }
+        if (options.pid >= 0 && pid != (uint32_t) options.pid) continue;
+
+        switch (event) {
+        case PGTRACE_READ:
+        case PGTRACE_WRITE:
+            if (event == PGTRACE_READ) trace_stats.reads++;
+            else trace_stats.writes++;
+            add_reference(
+                    page_number((uint64_t) pid << 20 | PGTRACE_VADDR(rec.page) >> 12),
+                    event == PGTRACE_WRITE
+            );
+            break;
+        case PGTRACE_EVICT_DIRTY: trace_stats.dirty_evictions++; /* fall through */
+        case PGTRACE_EVICT: trace_stats.evictions++; break;
+        default: error("unknown event %u in trace\n", event);
+        }
+    }
+    if (ferror(fp)) error("could not read trace '%s'\n", filename);
+}
+
+/* For OPT: where each page is referenced next, found walking backwards */
+static void compute_next_use(void)
+{
+    uint32_t *last = malloc(refs.pages * sizeof(uint32_t));
+
+    refs.next_use = malloc(refs.count * sizeof(uint32_t));
+    if (!last || !refs.next_use) error("out of memory\n");
+
+    for (uint32_t p = 0; p < refs.pages; p++) last[p] = NEVER;
+    for (uint32_t i = refs.count; i-- > 0;) {
+        refs.next_use[i]   = last[refs.page[i]];
+        last[refs.page[i]] = i;
+    }
+    free(last);
+}
+
+/* === Simulation === */
+
+static uint32_t random_state = 12345;
+
+static uint32_t random_frame(uint32_t nframes)
+{
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state / 65536) % nframes;
+}
+
+/*
+ * Replays the reference string with 'nframes' frames. 'stamp' is per
+ * frame: the reference bit for Clock, the time of last use for LRU and the
+ * time of next use for OPT.
+ */
+static struct sim_result simulate(enum policy policy, uint32_t nframes)
+{
+    struct sim_result result = {0, 0};
+
+    int32_t  *frame_page = malloc(nframes * sizeof(int32_t));
+    uint32_t *stamp      = malloc(nframes * sizeof(uint32_t));
+    int32_t  *page_frame = malloc(refs.pages * sizeof(int32_t));
+    bool     *dirty      = calloc(refs.pages, sizeof(bool));
+    uint32_t  used = 0, hand = 0;
+
+    if (!frame_page || !stamp || !page_frame || !dirty) error("out of memory\n");
+    for (uint32_t p = 0; p < refs.pages; p++) page_frame[p] = NO_PAGE;
+    random_state = 12345;
+
+    for (uint32_t i = 0; i < refs.count; i++) {
+        uint32_t page  = refs.page[i];
+        int32_t  frame = page_frame[page];
+
+        if (frame == NO_PAGE) {
+            result.faults++;
+
+            if (used < nframes) {
+                frame = used++;
+            } else {
+                switch (policy) {
+                case POLICY_FIFO:
+                    // frames are refilled in place, so they age in order
+                    frame = hand;
+                    hand  = (hand + 1) % nframes;
+                    break;
+                case POLICY_RANDOM: frame = random_frame(nframes); break;
+                case POLICY_CLOCK:
+                    while (stamp[hand]) {
+                        stamp[hand] = 0;
+                        hand        = (hand + 1) % nframes;
+                    }
+                    frame = hand;
+                    hand  = (hand + 1) % nframes;
+                    break;
+                case POLICY_LRU:
+                case POLICY_OPT:
+                    frame = 0;
+                    for (uint32_t f = 1; f < nframes; f++) {
+                        if (policy == POLICY_LRU ? stamp[f] < stamp[frame]
+                                                 : stamp[f] > stamp[frame]) {
+                            frame = f;
+                        }
+                    }
+                    break;
+                default: error("unknown policy %d\n", policy);
+                }
+
+                int32_t victim = frame_page[frame];
+                if (dirty[victim]) result.writes++;
+                dirty[victim]      = false;
+                page_frame[victim] = NO_PAGE;
+            }
+            frame_page[frame] = page;
+            page_frame[page]  = frame;
+        }
+
+        if (refs.write[i]) dirty[page] = true;
+        switch (policy) {
+        case POLICY_CLOCK: stamp[frame] = 1; break;
+        case POLICY_LRU: stamp[frame] = i; break;
+        case POLICY_OPT: stamp[frame] = refs.next_use[i]; break;
+        default: break;
+        }
+    }
+
+    free(frame_page);
+    free(stamp);
+    free(page_frame);
+    free(dirty);
+    return result;
+}
+
+static void report(void)
+{
+    printf("trace: %u records over %u ms, %u lost\n", trace_stats.records,
+           (trace_stats.last_time - trace_stats.first_time) / 1000, trace_stats.lost);
+    printf("kernel: %u faults (%u reads, %u writes), %u evictions (%u dirty)\n",
+           trace_stats.reads + trace_stats.writes, trace_stats.reads,
+           trace_stats.writes, trace_stats.evictions, trace_stats.dirty_evictions);
+    printf("replaying %u references to %u distinct pages\n\n", refs.count, refs.pages);
+
+    printf("%7s  %-7s %8s %7s %8s %10s\n", "frames", "policy", "faults", "fault%",
+           "writes", "I/O KB");
+    for (size_t r = 0; r < options.frame_runs; r++) {
+        for (int policy = 0; policy < POLICY_COUNT; policy++) {
+            struct sim_result res = simulate(policy, options.frames[r]);
+            printf("%7u  %-7s %8u %6.1f%% %8u %10u\n", options.frames[r],
+                   policy_names[policy], res.faults,
+                   100.0 * res.faults / refs.count, res.writes,
+                   (res.faults + res.writes) * PAGE_KB);
+        }
+        printf("\n");
+    }
+}
+
+ATTR_PRINTFLIKE(1, 2) static void usage_error(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s: ", options.progname);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+
+    fprintf(stderr, "usage: %s", options.progname);
+    size_t n = sizeof(usage_args) / sizeof(char *);
+    for (size_t i = 0; i < n; i++) {
+        fprintf(stderr, " %s", usage_args[i]);
+    }
+    fprintf(stderr, "\n");
+
+    exit(EXIT_FAILURE);
+}
+
+/* print an error message and exit */
+ATTR_PRINTFLIKE(1, 2) static void error(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "%s: ", options.progname);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+
+    if (errno != 0) {
+        perror(NULL);
+    }
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,126 @@
+/*
+ * Tests for the page replacement simulator, replaying hand-built traces.
+ *
+ * The simulator is a program, so it is included here whole, with its
+ * main() renamed out of the way of the one libunittest provides.
+ */
+#define main pagesim_main
+#include "pagesim.c"
+#undef main
+
+#include <unittest/unittest.h>
+
+/* The textbook reference string, that shows Belady's anomaly for FIFO */
+static const uint32_t belady_pages[] = {1, 2, 3, 4, 1, 2, 5, 1, 2, 3, 4, 5};
+
+enum { BELADY_REFS = sizeof(belady_pages) / sizeof(belady_pages[0]) };
+
+/*
+ * Write 'n' records after a header to a temporary file and read it back,
+ * keeping the references of process 'pid' only, or of all if it is -1
+ */
+static void replay(const struct pgtrace_record *recs, size_t n, int pid)
+{
+    struct pgtrace_record header = {PGTRACE_MAGIC, PGTRACE_VERSION, 0};
+    FILE                 *fp     = tmpfile();
+
+    if (!fp) error("could not create a trace\n");
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(recs, sizeof(*recs), n, fp);
+    rewind(fp);
+
+    options.progname = "pagesim_test";
+    options.pid      = pid;
+    memset(&trace_stats, 0, sizeof(trace_stats));
+    refs.count = refs.pages = 0;
+    free(refs.next_use);
+    refs.next_use = NULL;
+    if (page_table.key) memset(page_table.key, 0, page_table.size * sizeof(uint64_t));
+
+    read_trace(fp, "test trace");
+    fclose(fp);
+    compute_next_use();
+}
+
+/* Replay belady_pages as read faults of process 'pid' */
+static void replay_belady(uint32_t pid)
+{
+    struct pgtrace_record recs[BELADY_REFS];
+
+    for (int i = 0; i < BELADY_REFS; i++) {
+        recs[i] = (struct pgtrace_record){
+                .time = i,
+                .page = PGTRACE_PAGE(belady_pages[i] << 12, PGTRACE_READ),
+                .pid  = pid,
+        };
+    }
+    replay(recs, BELADY_REFS, -1);
+}
+
+static int faults(enum policy policy, uint32_t nframes)
+{
+    return simulate(policy, nframes).faults;
+}
+
+int test_pagesim_fault_counts()
+{
+    replay_belady(1);
+    tassert_eq((int) refs.count, BELADY_REFS);
+    tassert_eq((int) refs.pages, 5);
+
+    tassert_eq(faults(POLICY_FIFO, 3), 9);
+    tassert_eq(faults(POLICY_LRU, 3), 10);
+    tassert_eq(faults(POLICY_OPT, 3), 7);
+
+    /* more frames, more faults for FIFO */
+    tassert_eq(faults(POLICY_FIFO, 4), 10);
+    tassert_eq(faults(POLICY_LRU, 4), 8);
+    tassert_eq(faults(POLICY_OPT, 4), 6);
+
+    /* with room for every page, only the first touch of each faults */
+    tassert_eq(faults(POLICY_FIFO, 5), 5);
+    tassert_eq(faults(POLICY_LRU, 5), 5);
+    tassert_eq(faults(POLICY_OPT, 5), 5);
+
+    return TEST_PASS;
+}
+
+int test_pagesim_dirty_writes()
+{
+    struct pgtrace_record recs[] = {
+            {0, PGTRACE_PAGE(0x1000, PGTRACE_WRITE), 1},
+            {1, PGTRACE_PAGE(0x2000, PGTRACE_READ), 1},
+            {2, PGTRACE_PAGE(0x3000, PGTRACE_READ), 1},
+            {3, PGTRACE_PAGE(0x1000, PGTRACE_READ), 1},
+    };
+
+    replay(recs, sizeof(recs) / sizeof(recs[0]), -1);
+
+    /* FIFO throws out the written page first, and has to write it back */
+    struct sim_result res = simulate(POLICY_FIFO, 2);
+    tassert_eq((int) res.faults, 4);
+    tassert_eq((int) res.writes, 1);
+
+    return TEST_PASS;
+}
+
+int test_pagesim_pids_do_not_wrap()
+{
+    /* the same page of processes whose pids differ by a multiple of 256 */
+    struct pgtrace_record recs[] = {
+            {0, PGTRACE_PAGE(0x1000, PGTRACE_READ), 1},
+            {1, PGTRACE_PAGE(0x1000, PGTRACE_READ), 257},
+            {2, PGTRACE_PAGE(0x1000, PGTRACE_READ), 65537},
+            {3, PGTRACE_PAGE(0x1000, PGTRACE_READ), 1},
+    };
+
+    replay(recs, sizeof(recs) / sizeof(recs[0]), -1);
+    tassert_eq((int) refs.pages, 3);
+    tassert_eq(faults(POLICY_LRU, 3), 3);
+
+    /* and --pid picks out just one of them */
+    replay(recs, sizeof(recs) / sizeof(recs[0]), 257);
+    tassert_eq((int) refs.count, 1);
+
+    return TEST_PASS;
+}
@@ -146,7 +146,7 @@ int main(void)
                     ;
 
                 if (dir->location != 0) {
-                    load_code = loadproc(dir->location, dir->size);
+                    load_code = loadproc(dir->location, dir->size, dir->mem_size);
                     if (load_code == 0) shprintf("Done.\n");
                     else if (load_code == 1) shprintf("Too much competition for pages. Try again later.\n");
                     else shprintf("error");